@@ -0,0 +1,225 @@
+//Streaming detection of traffic rate anomalies
+
+#include <math.h>
+#include <string.h>
+
+#include "AnomalyDetector.h"
+
+namespace EtwNetwork
+{
+
+#define ANOMALY_PROBES 8 //table slots checked per lookup
+#define ANOMALY_MAX_IDLE_UPDATES 16 //empty intervals folded into the baseline one by one, the rest are skipped
+
+AnomalyDetector::AnomalyDetector(uint32_t capacity)
+{
+	uint32_t n = 16;
+	while (n < capacity) n *= 2;
+
+	this->capacity = n;
+	table = new AnomalyEntry[n];
+
+	interval = 10000000; //1 s
+	alpha = 0.02;
+	threshold = 4.0;
+	warmup = 30;
+	MinValue[AnomalyMetricSent] = 65536;
+	MinValue[AnomalyMetricRecv] = 65536;
+	MinValue[AnomalyMetricRetransmits] = 10;
+	seasonal = false;
+	TimeZoneBias = 0;
+	KindMask = (1 << AnomalyKeyProcess) | (1 << AnomalyKeySubnet) | (1 << AnomalyKeyPort);
+	callback = NULL;
+	context = NULL;
+
+	Clear();
+}
+
+AnomalyDetector::~AnomalyDetector()
+{
+	delete[] table;
+}
+
+void AnomalyDetector::Clear()
+{
+	memset(table, 0, sizeof(AnomalyEntry) * capacity);
+	NextSweep = 0;
+}
+
+uint32_t AnomalyDetector::KeyCount() const
+{
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < capacity; i++) if (table[i].used) n++;
+	return n;
+}
+
+// Finds the entry of the key the record belongs to, or takes a free slot for it.
+// When all probed slots are taken, the one that was idle for the longest time is reused.
+
+AnomalyEntry * AnomalyDetector::Lookup(uint8_t kind, const NetRecord & rec, uint64_t BucketStart)
+{
+	uint32_t pid = 0;
+	uint16_t port = 0;
+	uint8_t subnet[16];
+	uint32_t h = 2166136261U;
+	AnomalyEntry * victim = NULL;
+
+	memset(subnet, 0, sizeof(subnet));
+	switch (kind)
+	{
+	case AnomalyKeyProcess: pid = rec.pid; break;
+	case AnomalyKeyPort: port = rec.dport; break; //daddr/dport is the remote end
+	case AnomalyKeySubnet: memcpy(subnet, rec.daddr, rec.ip6 ? 8 : 3); break;
+	}
+
+	h = (h ^ kind) * 16777619U;
+	h = (h ^ pid) * 16777619U;
+	h = (h ^ port) * 16777619U;
+	for (int i = 0; i < 8; i++) h = (h ^ subnet[i]) * 16777619U;
+	h ^= h >> 15;
+
+	for (uint32_t p = 0; p < ANOMALY_PROBES; p++)
+	{
+		AnomalyEntry * e = &table[(h + p) & (capacity - 1)];
+
+		if (!e->used)
+		{
+			victim = e;
+			break;
+		}
+		if (e->kind == kind && e->pid == pid && e->port == port && e->ip6 == rec.ip6 &&
+			memcmp(e->subnet, subnet, sizeof(subnet)) == 0)
+		{
+			return e;
+		}
+		if (victim == NULL || e->BucketStart < victim->BucketStart) victim = e;
+	}
+
+	memset(victim, 0, sizeof(AnomalyEntry));
+	victim->used = 1;
+	victim->kind = kind;
+	victim->ip6 = rec.ip6;
+	victim->pid = pid;
+	victim->port = port;
+	memcpy(victim->subnet, subnet, sizeof(subnet));
+	victim->BucketStart = BucketStart;
+	return victim;
+}
+
+//Scores the open interval against the baseline and then folds it into the baseline
+void AnomalyDetector::CloseInterval(AnomalyEntry * e)
+{
+	uint32_t hour = (uint32_t)((((int64_t)(e->BucketStart / 600000000ULL) + TimeZoneBias) / 60 % 24 + 24) % 24);
+	bool UseHourly = seasonal && e->HourSamples[hour] >= warmup;
+
+	for (int m = 0; m < AnomalyMetrics; m++)
+	{
+		double x = e->current[m];
+		AnomalyBaseline & b = UseHourly ? e->hourly[hour][m] : e->overall[m];
+		AnomalyBaseline * update[2] = { &e->overall[m], &e->hourly[hour][m] };
+
+		if (callback != NULL && e->samples >= warmup && x >= MinValue[m] && x > b.mean)
+		{
+			//the floor keeps flat baselines (variance near 0) from alerting on small changes
+			double deviation = sqrt((double)b.var);
+			double floor = 0.1 * b.mean + 1.0;
+			if (deviation < floor) deviation = floor;
+
+			if ((x - b.mean) / deviation > threshold)
+			{
+				AnomalyAlert alert;
+				alert.kind = e->kind;
+				alert.metric = (uint8_t)m;
+				alert.ip6 = e->ip6;
+				alert.pid = e->pid;
+				alert.port = e->port;
+				memcpy(alert.subnet, e->subnet, sizeof(alert.subnet));
+				alert.IntervalStart = e->BucketStart;
+				alert.value = x;
+				alert.mean = b.mean;
+				alert.deviation = deviation;
+				alert.score = (x - b.mean) / deviation;
+				callback(alert, context);
+			}
+		}
+
+		//EWMA of mean and variance (West, 1979)
+		for (int k = 0; k < (seasonal ? 2 : 1); k++)
+		{
+			AnomalyBaseline * u = update[k];
+			double diff = x - u->mean;
+			double incr = alpha * diff;
+			if (k == 1 && e->HourSamples[hour] == 0) { u->mean = (float)x; continue; }
+			if (k == 0 && e->samples == 0) { u->mean = (float)x; continue; }
+			u->mean = (float)(u->mean + incr);
+			u->var = (float)((1.0 - alpha) * (u->var + diff * incr));
+		}
+
+		e->current[m] = 0;
+	}
+
+	e->samples++;
+	if (seasonal && e->HourSamples[hour] < 0xFFFF) e->HourSamples[hour]++;
+	e->BucketStart += interval;
+}
+
+void AnomalyDetector::CloseIntervals(AnomalyEntry * e, uint64_t now)
+{
+	uint32_t n = 0;
+
+	while (e->BucketStart + interval <= now && n < ANOMALY_MAX_IDLE_UPDATES)
+	{
+		CloseInterval(e);
+		n++;
+	}
+
+	//long idle period: skip to the current interval
+	if (e->BucketStart + interval <= now) e->BucketStart = now - now % interval;
+}
+
+void AnomalyDetector::Process(const NetRecord & rec)
+{
+	uint64_t BucketStart;
+	int m;
+	double value;
+
+	if (NetOpcodeIsSend(rec.opcode)) { m = AnomalyMetricSent; value = (double)rec.size * rec.weight; }
+	else if (NetOpcodeIsRecv(rec.opcode)) { m = AnomalyMetricRecv; value = (double)rec.size * rec.weight; }
+	else if (rec.opcode == NET_OPCODE_RETRANSMIT || rec.opcode == NET_OPCODE_RETRANSMIT_IP6)
+	{
+		m = AnomalyMetricRetransmits;
+		value = rec.weight;
+	}
+	else return;
+
+	if (interval == 0) interval = 10000000;
+	if (rec.timestamp >= NextSweep) Sweep(rec.timestamp);
+	BucketStart = rec.timestamp - rec.timestamp % interval;
+
+	for (uint8_t kind = 0; kind < AnomalyKeyKinds; kind++)
+	{
+		if ((KindMask & (1 << kind)) == 0) continue;
+
+		AnomalyEntry * e = Lookup(kind, rec, BucketStart);
+		if (rec.timestamp >= e->BucketStart + interval) CloseIntervals(e, rec.timestamp);
+		e->current[m] += value;
+	}
+}
+
+// Closes finished intervals of all keys, so that a burst is reported even if the key sees no
+// further events. Called from Process once per interval, which keeps the cost per event O(1).
+
+void AnomalyDetector::Sweep(uint64_t now)
+{
+	if (interval == 0) interval = 10000000;
+
+	for (uint32_t i = 0; i < capacity; i++)
+	{
+		AnomalyEntry * e = &table[i];
+		if (e->used && e->BucketStart + interval <= now) CloseIntervals(e, now);
+	}
+
+	NextSweep = now - now % interval + interval;
+}
+
+} // END NAMESPACE
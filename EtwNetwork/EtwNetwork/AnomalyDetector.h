@@ -0,0 +1,110 @@
+//Streaming detection of traffic rate anomalies
+#pragma once
+
+#include <stdint.h>
+
+#include "NetRecord.h"
+
+namespace EtwNetwork
+{
+
+enum AnomalyKeyKind
+{
+	AnomalyKeyProcess = 0, //traffic of one process
+	AnomalyKeySubnet = 1, //traffic to one remote /24 (IPv4) or /64 (IPv6) subnet
+	AnomalyKeyPort = 2, //traffic to one remote port
+	AnomalyKeyKinds = 3
+};
+
+enum AnomalyMetric
+{
+	AnomalyMetricSent = 0, //sent bytes per interval
+	AnomalyMetricRecv = 1, //received bytes per interval
+	AnomalyMetricRetransmits = 2, //retransmit events per interval
+	AnomalyMetrics = 3
+};
+
+struct AnomalyAlert
+{
+	uint8_t kind; //AnomalyKeyKind
+	uint8_t metric; //AnomalyMetric
+	uint8_t ip6;
+	uint32_t pid;
+	uint16_t port;
+	uint8_t subnet[16];
+	uint64_t IntervalStart; //FILETIME
+	double value; //observed value in the interval
+	double mean; //expected value
+	double deviation; //standard deviation used for the score
+	double score; //(value - mean) / deviation
+};
+
+typedef void (*AnomalyCallback)(const AnomalyAlert & alert, void * context);
+
+struct AnomalyBaseline
+{
+	float mean;
+	float var;
+};
+
+struct AnomalyEntry
+{
+	uint8_t used;
+	uint8_t kind;
+	uint8_t ip6;
+	uint32_t pid;
+	uint16_t port;
+	uint8_t subnet[16];
+	uint64_t BucketStart;
+	double current[AnomalyMetrics]; //values accumulated in the open interval
+	uint32_t samples; //closed intervals so far
+	AnomalyBaseline overall[AnomalyMetrics];
+	uint16_t HourSamples[24];
+	AnomalyBaseline hourly[24][AnomalyMetrics]; //time-of-day baselines, used when seasonality is on
+};
+
+// Keeps EWMA mean and variance of sent/received bytes and retransmits per interval for every
+// process, remote subnet and remote port, and reports intervals deviating upwards from the baseline.
+// Uses a fixed-size table (keys beyond capacity replace the least recently active ones), and
+// does O(1) work per event plus one sweep of the table per interval.
+// Not thread-safe: must be called from one thread.
+
+class AnomalyDetector
+{
+public:
+	//Settings
+	uint64_t interval; //length of the interval rates are measured over, 100 ns units
+	double alpha; //EWMA smoothing factor per interval
+	double threshold; //score that raises an alert
+	uint32_t warmup; //intervals observed before a key can raise alerts
+	double MinValue[AnomalyMetrics]; //values below this never raise alerts
+	bool seasonal; //use per hour-of-day baselines
+	int32_t TimeZoneBias; //minutes added to UTC to get the local hour of day
+	uint8_t KindMask; //bit per AnomalyKeyKind to track
+	AnomalyCallback callback;
+	void * context;
+
+	AnomalyDetector(uint32_t capacity);
+	~AnomalyDetector();
+
+	void Process(const NetRecord & rec);
+	void Sweep(uint64_t now); //closes the intervals that ended before "now" for all keys
+	void Clear();
+
+	uint32_t KeyCount() const;
+	uint32_t Capacity() const { return capacity; }
+
+private:
+	AnomalyEntry * table;
+	uint32_t capacity; //power of 2
+	uint64_t NextSweep;
+
+	AnomalyDetector(const AnomalyDetector &);
+	AnomalyDetector & operator=(const AnomalyDetector &);
+
+	AnomalyEntry * Lookup(uint8_t kind, const NetRecord & rec, uint64_t BucketStart);
+	void CloseIntervals(AnomalyEntry * e, uint64_t now);
+	void CloseInterval(AnomalyEntry * e);
+};
+
+} // END NAMESPACE
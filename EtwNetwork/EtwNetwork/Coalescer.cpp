@@ -0,0 +1,195 @@
+//Flow-level coalescing of send/receive events
+
+#include <string.h>
+
+#include "Coalescer.h"
+
+namespace EtwNetwork
+{
+
+#define COALESCE_NONE 0xFFFFFFFF
+
+FlowCoalescer::FlowCoalescer()
+{
+	window = 100000; //10 ms
+	MaxEvents = 0;
+	callback = NULL;
+	context = NULL;
+	EventsIn = 0;
+	RecordsOut = 0;
+	serial = 0;
+	open = 0;
+}
+
+static bool SameFlow(const NetRecord & a, const NetRecord & b)
+{
+	uint32_t AddrLength = a.ip6 ? 16 : 4;
+
+	return a.pid == b.pid && a.proto == b.proto && a.ip6 == b.ip6 && a.dport == b.dport && a.sport == b.sport &&
+		memcmp(a.daddr, b.daddr, AddrLength) == 0 && memcmp(a.saddr, b.saddr, AddrLength) == 0;
+}
+
+uint32_t FlowCoalescer::Find(const NetRecord & rec, uint32_t hash) const
+{
+	typedef std::unordered_multimap<uint32_t, uint32_t>::const_iterator Iter;
+	std::pair<Iter, Iter> range = index.equal_range(hash);
+
+	for (Iter it = range.first; it != range.second; ++it)
+	{
+		if (SameFlow(records[it->second].r.rec, rec)) return it->second;
+	}
+	return COALESCE_NONE;
+}
+
+uint32_t FlowCoalescer::Open(const NetRecord & rec, uint32_t hash, uint8_t version, const NetConnection * conn)
+{
+	uint32_t i;
+
+	if (!FreeRecords.empty())
+	{
+		i = FreeRecords.back();
+		FreeRecords.pop_back();
+	}
+	else
+	{
+		i = (uint32_t)records.size();
+		records.push_back(OpenRecord());
+	}
+
+	OpenRecord & o = records[i];
+	o.r.rec = rec;
+	o.r.LastTimestamp = rec.timestamp;
+	o.r.events = 1;
+	o.r.version = version;
+	o.r.HasConnection = conn != NULL;
+	if (conn != NULL) o.r.conn = *conn;
+	else memset(&o.r.conn, 0, sizeof(o.r.conn));
+	o.hash = hash;
+	o.serial = ++serial;
+	o.used = true;
+
+	index.insert(std::make_pair(hash, i));
+	order.push_back(std::make_pair(i, o.serial));
+	open++;
+
+	//records emitted before their window ended leave stale entries behind the oldest open one
+	if (order.size() > 2 * open + 1024) Compact();
+	return i;
+}
+
+void FlowCoalescer::Compact()
+{
+	std::deque<std::pair<uint32_t, uint32_t> > live;
+
+	for (size_t k = 0; k < order.size(); k++)
+	{
+		const OpenRecord & o = records[order[k].first];
+		if (o.used && o.serial == order[k].second) live.push_back(order[k]);
+	}
+	order.swap(live);
+}
+
+//Passes the record to the callback and frees its slot; the entry in "order" goes stale
+void FlowCoalescer::Emit(uint32_t i)
+{
+	typedef std::unordered_multimap<uint32_t, uint32_t>::iterator Iter;
+	OpenRecord & o = records[i];
+	std::pair<Iter, Iter> range = index.equal_range(o.hash);
+
+	for (Iter it = range.first; it != range.second; ++it)
+	{
+		if (it->second == i)
+		{
+			index.erase(it);
+			break;
+		}
+	}
+
+	o.used = false;
+	FreeRecords.push_back(i);
+	open--;
+	RecordsOut++;
+	if (callback != NULL) callback(o.r, context);
+}
+
+bool FlowCoalescer::Process(const NetRecord & rec, uint8_t version, const NetConnection * conn)
+{
+	uint32_t hash = NetRecordFlowHash(&rec);
+	uint32_t i;
+
+	Expire(rec.timestamp);
+	i = Find(rec, hash);
+
+	if (!NetOpcodeIsData(rec.opcode))
+	{
+		if (i != COALESCE_NONE) Emit(i);
+		return false;
+	}
+
+	EventsIn++;
+
+	if (i != COALESCE_NONE)
+	{
+		CoalescedRecord & r = records[i].r;
+
+		//opcode covers direction and address family
+		if (r.rec.opcode == rec.opcode && r.rec.weight == rec.weight && r.rec.size + rec.size >= r.rec.size &&
+			(window == 0 || rec.timestamp < r.rec.timestamp + window))
+		{
+			r.rec.size += rec.size;
+			if (rec.timestamp > r.LastTimestamp) r.LastTimestamp = rec.timestamp;
+			r.events++;
+			if (MaxEvents != 0 && r.events >= MaxEvents) Emit(i);
+			return true;
+		}
+
+		Emit(i);
+	}
+
+	i = Open(rec, hash, version, conn);
+	if (MaxEvents == 1) Emit(i);
+	return true;
+}
+
+void FlowCoalescer::Expire(uint64_t now)
+{
+	while (!order.empty())
+	{
+		const OpenRecord & o = records[order.front().first];
+
+		if (!o.used || o.serial != order.front().second)
+		{
+			order.pop_front(); //already emitted
+			continue;
+		}
+
+		if (window == 0 || o.r.rec.timestamp + window > now) break;
+
+		uint32_t i = order.front().first;
+		order.pop_front();
+		Emit(i);
+	}
+}
+
+void FlowCoalescer::Flush()
+{
+	while (!order.empty())
+	{
+		uint32_t i = order.front().first;
+		uint32_t s = order.front().second;
+
+		order.pop_front();
+		if (records[i].used && records[i].serial == s) Emit(i);
+	}
+}
+
+void FlowCoalescer::Clear()
+{
+	records.clear();
+	FreeRecords.clear();
+	index.clear();
+	order.clear();
+	open = 0;
+}
+
+} // END NAMESPACE
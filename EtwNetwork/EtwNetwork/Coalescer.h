@@ -0,0 +1,80 @@
+//Flow-level coalescing of send/receive events
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+#include "NetRecord.h"
+
+namespace EtwNetwork
+{
+
+struct CoalescedRecord
+{
+	NetRecord rec; //flow of the merged events; size is the sum of their sizes, timestamp is that of the first one
+	uint64_t LastTimestamp; //FILETIME of the last merged event
+	NetConnection conn; //of the first merged event, if HasConnection
+	uint32_t events; //number of merged events
+	uint8_t version; //event version
+	uint8_t HasConnection;
+};
+
+typedef void (*CoalesceCallback)(const CoalescedRecord & rec, void * context);
+
+// Merges consecutive send or receive events of the same flow into one record. A record is emitted when
+// the flow changes direction, when its window or event limit is reached, when an event changing the
+// connection state arrives for the flow, or on Flush. Sizes are summed exactly; events are only merged
+// with events of the same sampling weight.
+// Not thread-safe: must be called from one thread.
+
+class FlowCoalescer
+{
+public:
+	//Settings
+	uint64_t window; //longest time from the first to the last merged event, 100 ns units, 0 = unlimited
+	uint32_t MaxEvents; //most events merged into one record, 0 = unlimited
+	CoalesceCallback callback;
+	void * context;
+
+	//Statistics
+	uint64_t EventsIn; //send/receive events merged
+	uint64_t RecordsOut; //records emitted for them
+
+	FlowCoalescer();
+
+	// Returns true if the event was taken in (send/receive events). For other events, the pending record
+	// of their flow is emitted and false is returned: the caller passes the event on after that record.
+	bool Process(const NetRecord & rec, uint8_t version, const NetConnection * conn = NULL);
+
+	void Expire(uint64_t now); //emits records whose window ended before "now"
+	void Flush(); //emits all pending records
+	void Clear(); //drops all pending records
+
+	size_t Pending() const { return open; }
+
+private:
+	struct OpenRecord
+	{
+		CoalescedRecord r;
+		uint32_t hash;
+		uint32_t serial; //changes every time the slot is reused
+		bool used;
+	};
+
+	std::vector<OpenRecord> records;
+	std::vector<uint32_t> FreeRecords;
+	std::unordered_multimap<uint32_t, uint32_t> index; //flow hash -> record
+	std::deque<std::pair<uint32_t, uint32_t> > order; //(record, serial) in the order records were opened
+	uint32_t serial;
+	size_t open;
+
+	uint32_t Find(const NetRecord & rec, uint32_t hash) const;
+	uint32_t Open(const NetRecord & rec, uint32_t hash, uint8_t version, const NetConnection * conn);
+	void Emit(uint32_t i);
+	void Compact();
+};
+
+} // END NAMESPACE
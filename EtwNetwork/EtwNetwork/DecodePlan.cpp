@@ -0,0 +1,563 @@
+//Precompiled decoding plans for events described by TDH schemas
+
+#include <string.h>
+
+#include "DecodePlan.h"
+
+namespace EtwNetwork
+{
+
+#define PLAN_MAX_DEPTH 8 //nesting of structures
+
+/* ****** Compiler ****** */
+
+static uint8_t InTypeSize(uint16_t InType, uint32_t PointerSize)
+{
+	switch (InType)
+	{
+	case PLAN_INTYPE_INT8: case PLAN_INTYPE_UINT8: case PLAN_INTYPE_ANSICHAR:
+		return 1;
+	case PLAN_INTYPE_INT16: case PLAN_INTYPE_UINT16: case PLAN_INTYPE_UNICODECHAR:
+		return 2;
+	case PLAN_INTYPE_INT32: case PLAN_INTYPE_UINT32: case PLAN_INTYPE_HEXINT32:
+	case PLAN_INTYPE_FLOAT: case PLAN_INTYPE_BOOLEAN:
+		return 4;
+	case PLAN_INTYPE_INT64: case PLAN_INTYPE_UINT64: case PLAN_INTYPE_HEXINT64:
+	case PLAN_INTYPE_DOUBLE: case PLAN_INTYPE_FILETIME:
+		return 8;
+	case PLAN_INTYPE_GUID: case PLAN_INTYPE_SYSTEMTIME:
+		return 16;
+	case PLAN_INTYPE_POINTER: case PLAN_INTYPE_SIZET:
+		return (uint8_t)PointerSize;
+	default:
+		return 0; //variable size or not supported
+	}
+}
+
+//How the interpreter formats a fixed-size value; everything else goes to TdhFormatProperty
+static uint8_t FixedFormat(uint16_t InType, uint16_t OutType)
+{
+	switch (InType)
+	{
+	case PLAN_INTYPE_INT8:
+		return (OutType == PLAN_OUTTYPE_NULL || OutType == PLAN_OUTTYPE_BYTE) ? PlanFormatSigned : PlanFormatTdh;
+	case PLAN_INTYPE_INT16:
+		return (OutType == PLAN_OUTTYPE_NULL || OutType == PLAN_OUTTYPE_SHORT) ? PlanFormatSigned : PlanFormatTdh;
+	case PLAN_INTYPE_INT32:
+		return (OutType == PLAN_OUTTYPE_NULL || OutType == PLAN_OUTTYPE_INT) ? PlanFormatSigned : PlanFormatTdh;
+	case PLAN_INTYPE_INT64:
+		return (OutType == PLAN_OUTTYPE_NULL || OutType == PLAN_OUTTYPE_LONG) ? PlanFormatSigned : PlanFormatTdh;
+	case PLAN_INTYPE_UINT8:
+		if (OutType == PLAN_OUTTYPE_NULL || OutType == PLAN_OUTTYPE_UNSIGNEDBYTE) return PlanFormatUnsigned;
+		if (OutType == PLAN_OUTTYPE_HEXINT8) return PlanFormatHex;
+		return PlanFormatTdh;
+	case PLAN_INTYPE_UINT16:
+		if (OutType == PLAN_OUTTYPE_NULL || OutType == PLAN_OUTTYPE_UNSIGNEDSHORT) return PlanFormatUnsigned;
+		if (OutType == PLAN_OUTTYPE_HEXINT16) return PlanFormatHex;
+		if (OutType == PLAN_OUTTYPE_PORT) return PlanFormatPort;
+		return PlanFormatTdh;
+	case PLAN_INTYPE_UINT32:
+		if (OutType == PLAN_OUTTYPE_NULL || OutType == PLAN_OUTTYPE_UNSIGNEDINT || OutType == PLAN_OUTTYPE_UNSIGNEDLONG ||
+			OutType == PLAN_OUTTYPE_PID || OutType == PLAN_OUTTYPE_TID) return PlanFormatUnsigned;
+		if (OutType == PLAN_OUTTYPE_HEXINT32) return PlanFormatHex;
+		if (OutType == PLAN_OUTTYPE_IPV4) return PlanFormatIpv4;
+		return PlanFormatTdh;
+	case PLAN_INTYPE_UINT64:
+		if (OutType == PLAN_OUTTYPE_NULL || OutType == PLAN_OUTTYPE_UNSIGNEDLONG) return PlanFormatUnsigned;
+		if (OutType == PLAN_OUTTYPE_HEXINT64) return PlanFormatHex;
+		return PlanFormatTdh;
+	case PLAN_INTYPE_HEXINT32:
+		return (OutType == PLAN_OUTTYPE_NULL || OutType == PLAN_OUTTYPE_HEXINT32) ? PlanFormatHex : PlanFormatTdh;
+	case PLAN_INTYPE_HEXINT64:
+		return (OutType == PLAN_OUTTYPE_NULL || OutType == PLAN_OUTTYPE_HEXINT64) ? PlanFormatHex : PlanFormatTdh;
+	case PLAN_INTYPE_POINTER:
+		return OutType == PLAN_OUTTYPE_NULL ? PlanFormatHex : PlanFormatTdh;
+	case PLAN_INTYPE_GUID:
+		return (OutType == PLAN_OUTTYPE_NULL || OutType == PLAN_OUTTYPE_GUID) ? PlanFormatGuid : PlanFormatTdh;
+	default:
+		return PlanFormatTdh;
+	}
+}
+
+//Only integers of up to 32 bits can hold a length or a count
+static bool IsLengthType(uint16_t InType)
+{
+	return InType == PLAN_INTYPE_INT8 || InType == PLAN_INTYPE_UINT8 || InType == PLAN_INTYPE_INT16 ||
+		InType == PLAN_INTYPE_UINT16 || InType == PLAN_INTYPE_INT32 || InType == PLAN_INTYPE_UINT32 ||
+		InType == PLAN_INTYPE_HEXINT32;
+}
+
+DecodePlan::DecodePlan()
+{
+	FixedSize = 0;
+	PointerSize = 8;
+	properties = NULL;
+	PropertyCount = 0;
+	slots = 0;
+}
+
+bool DecodePlan::Compile(const PlanProperty * properties, uint32_t count, uint32_t TopLevelCount, uint32_t PointerSize)
+{
+	uint32_t offset = 0;
+	bool ok = true;
+
+	steps.clear();
+	FixedSize = 0;
+	this->PointerSize = PointerSize;
+	this->properties = properties;
+	PropertyCount = count;
+	slots = 0;
+	SlotOf.assign(count, (uint8_t)PLAN_NO_SLOT);
+	emitted.assign(count, false);
+
+	if (TopLevelCount > count || count > 0xFFFF || (PointerSize != 4 && PointerSize != 8)) ok = false;
+
+	//properties referenced as lengths and counts keep their value in a slot
+	for (uint32_t i = 0; i < count && ok; i++)
+	{
+		uint16_t refs[2];
+		int n = 0;
+
+		if ((properties[i].flags & PLAN_PROPERTY_PARAM_LENGTH) != 0) refs[n++] = properties[i].length;
+		if ((properties[i].flags & PLAN_PROPERTY_PARAM_COUNT) != 0) refs[n++] = properties[i].count;
+
+		for (int r = 0; r < n; r++)
+		{
+			if (refs[r] >= count || slots >= PLAN_MAX_SLOTS) { ok = false; break; }
+			if (SlotOf[refs[r]] == PLAN_NO_SLOT) SlotOf[refs[r]] = (uint8_t)slots++;
+		}
+	}
+
+	for (uint32_t i = 0; i < TopLevelCount && ok; i++)
+	{
+		ok = CompileProperty((uint16_t)i, offset, 0);
+	}
+
+	//the table belongs to the caller
+	this->properties = NULL;
+	SlotOf.clear();
+	emitted.clear();
+
+	if (!ok) steps.clear();
+	return ok;
+}
+
+// Appends the steps of property i. "offset" is where the property starts in UserData and receives
+// where it ends, PLAN_DYNAMIC when that depends on the event.
+
+bool DecodePlan::CompileProperty(uint16_t i, uint32_t & offset, uint32_t depth)
+{
+	const PlanProperty & prop = properties[i];
+	PlanStep s;
+	uint32_t extent = PLAN_DYNAMIC;
+
+	if (depth > PLAN_MAX_DEPTH || steps.size() >= 0xFFFF) return false;
+	if ((prop.flags & (PLAN_PROPERTY_XML_FRAGMENT | PLAN_PROPERTY_CUSTOM_SCHEMA)) != 0) return false;
+
+	memset(&s, 0, sizeof(s));
+	s.property = i;
+	s.InType = prop.InType;
+	s.OutType = prop.OutType;
+	s.slot = SlotOf[i];
+	s.LengthSlot = PLAN_NO_SLOT;
+	s.CountSlot = PLAN_NO_SLOT;
+	s.count = prop.count;
+	s.offset = offset;
+
+	//a length or count must be decoded before the property using it
+	if ((prop.flags & PLAN_PROPERTY_PARAM_COUNT) != 0)
+	{
+		if (!emitted[prop.count]) return false;
+		s.CountSlot = SlotOf[prop.count];
+		s.count = 0;
+	}
+
+	if ((prop.flags & PLAN_PROPERTY_STRUCT) != 0)
+	{
+		bool single = s.CountSlot == PLAN_NO_SLOT && s.count == 1;
+		uint32_t inner = single ? offset : PLAN_DYNAMIC;
+		size_t at = steps.size();
+
+		if (s.slot != PLAN_NO_SLOT) return false;
+		if ((uint32_t)prop.StructStart + prop.StructMembers > PropertyCount) return false;
+
+		s.op = PlanOpStruct;
+		steps.push_back(s);
+		for (uint32_t j = prop.StructStart; j < (uint32_t)prop.StructStart + prop.StructMembers; j++)
+		{
+			if (!CompileProperty((uint16_t)j, inner, depth + 1)) return false;
+		}
+		steps[at].end = (uint32_t)steps.size();
+
+		if (single) offset = inner;
+		else if (s.CountSlot != PLAN_NO_SLOT || s.count != 0) offset = PLAN_DYNAMIC;
+		emitted[i] = true;
+		return true;
+	}
+
+	//length as GetPropertyLength determines it; strings are null-terminated and pointers and other
+	//fixed-size values may be reported with no length
+	if ((prop.flags & PLAN_PROPERTY_PARAM_LENGTH) != 0)
+	{
+		if (!emitted[prop.length]) return false;
+		s.LengthSlot = SlotOf[prop.length];
+	}
+	else if (prop.length > 0) s.length = prop.length;
+	else if (prop.InType == PLAN_INTYPE_BINARY && prop.OutType == PLAN_OUTTYPE_IPV6) s.length = 16;
+	else if (prop.InType == PLAN_INTYPE_BINARY) return false;
+
+	switch (prop.InType)
+	{
+	case PLAN_INTYPE_UNICODESTRING:
+	case PLAN_INTYPE_ANSISTRING:
+		//counted and fixed-length strings are left to TDH
+		if (s.LengthSlot != PLAN_NO_SLOT || s.length != 0) return false;
+		s.op = prop.InType == PLAN_INTYPE_UNICODESTRING ? PlanOpUnicodeString : PlanOpAnsiString;
+		s.format = (prop.InType == PLAN_INTYPE_UNICODESTRING && !prop.map &&
+			(prop.OutType == PLAN_OUTTYPE_NULL || prop.OutType == PLAN_OUTTYPE_STRING)) ? PlanFormatString : PlanFormatTdh;
+		break;
+
+	case PLAN_INTYPE_BINARY:
+		s.op = PlanOpBinary;
+		s.format = PlanFormatTdh;
+		if (s.LengthSlot == PLAN_NO_SLOT && s.CountSlot == PLAN_NO_SLOT) extent = (uint32_t)s.length * s.count;
+		break;
+
+	default:
+		s.size = InTypeSize(prop.InType, PointerSize);
+		if (s.size == 0 || s.LengthSlot != PLAN_NO_SLOT) return false;
+		if (s.length == 0) s.length = s.size;
+		s.op = PlanOpFixed;
+		s.format = prop.map ? (uint8_t)PlanFormatTdh : FixedFormat(prop.InType, prop.OutType);
+		if (s.CountSlot == PLAN_NO_SLOT) extent = (uint32_t)s.size * s.count;
+		break;
+	}
+
+	if (s.slot != PLAN_NO_SLOT && (s.op != PlanOpFixed || !IsLengthType(prop.InType))) return false;
+
+	steps.push_back(s);
+	emitted[i] = true;
+
+	if (offset != PLAN_DYNAMIC && extent != PLAN_DYNAMIC)
+	{
+		offset += extent;
+		if (offset > FixedSize) FixedSize = offset;
+	}
+	else offset = PLAN_DYNAMIC;
+
+	return true;
+}
+
+/* ****** Interpreter ****** */
+
+static inline uint64_t ReadUnsigned(const uint8_t * p, uint32_t size)
+{
+	uint64_t v = 0;
+	for (uint32_t i = size; i > 0; i--) v = (v << 8) | p[i - 1];
+	return v;
+}
+
+static void AppendAscii(std::vector<uint16_t> & text, const char * s)
+{
+	while (*s) text.push_back((uint8_t)*s++);
+}
+
+static void AppendDecimal(std::vector<uint16_t> & text, uint64_t v)
+{
+	char buf[24];
+	int n = 0;
+
+	do { buf[n++] = (char)('0' + v % 10); v /= 10; } while (v != 0);
+	while (n > 0) text.push_back((uint8_t)buf[--n]);
+}
+
+//Uppercase hex; digits = 0 drops leading zeros
+static void AppendHex(std::vector<uint16_t> & text, uint64_t v, int digits)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char buf[16];
+	int n = 0;
+
+	do { buf[n++] = hex[v & 15]; v >>= 4; } while (v != 0 || n < digits);
+	while (n > 0) text.push_back((uint8_t)buf[--n]);
+}
+
+//Formats the value as TdhFormatProperty does
+static void FormatValue(const PlanStep & s, PlanValue & v, DecodeOutput & out)
+{
+	const uint8_t * p = v.data;
+	uint64_t x;
+
+	v.text = (uint32_t)out.text.size();
+
+	switch (s.format)
+	{
+	case PlanFormatSigned:
+		x = ReadUnsigned(p, s.size);
+		if (s.size < 8 && (x >> (s.size * 8 - 1)) != 0) x |= ~0ULL << (s.size * 8); //sign extension
+		if ((int64_t)x < 0)
+		{
+			out.text.push_back('-');
+			x = 0 - x;
+		}
+		AppendDecimal(out.text, x);
+		break;
+
+	case PlanFormatUnsigned:
+		AppendDecimal(out.text, ReadUnsigned(p, s.size));
+		break;
+
+	case PlanFormatHex:
+		AppendAscii(out.text, "0x");
+		AppendHex(out.text, ReadUnsigned(p, s.size), 0);
+		break;
+
+	case PlanFormatPort:
+		AppendDecimal(out.text, ((uint32_t)p[0] << 8) | p[1]);
+		break;
+
+	case PlanFormatIpv4:
+		for (int i = 0; i < 4; i++)
+		{
+			if (i > 0) out.text.push_back('.');
+			AppendDecimal(out.text, p[i]);
+		}
+		break;
+
+	case PlanFormatGuid:
+		out.text.push_back('{');
+		AppendHex(out.text, ReadUnsigned(p, 4), 8);
+		out.text.push_back('-');
+		AppendHex(out.text, ReadUnsigned(p + 4, 2), 4);
+		out.text.push_back('-');
+		AppendHex(out.text, ReadUnsigned(p + 6, 2), 4);
+		out.text.push_back('-');
+		for (int i = 8; i < 16; i++)
+		{
+			if (i == 10) out.text.push_back('-');
+			AppendHex(out.text, p[i], 2);
+		}
+		out.text.push_back('}');
+		break;
+
+	case PlanFormatString:
+		for (uint32_t i = 0; i + 1 < v.size; i += 2)
+		{
+			uint16_t c = (uint16_t)(p[i] | (p[i + 1] << 8));
+			if (c == 0) break;
+			out.text.push_back(c);
+		}
+		break;
+	}
+
+	v.TextLength = (uint32_t)out.text.size() - v.text;
+}
+
+bool DecodePlan::Run(uint32_t begin, uint32_t end, const uint8_t * data, const uint8_t * & p, const uint8_t * last,
+	uint32_t * SlotValues, DecodeOutput & out) const
+{
+	uint32_t k = begin;
+
+	while (k < end)
+	{
+		const PlanStep & s = steps[k];
+		uint32_t n = s.CountSlot == PLAN_NO_SLOT ? s.count : (uint16_t)SlotValues[s.CountSlot];
+
+		if (s.offset != PLAN_DYNAMIC) p = data + s.offset;
+
+		if (s.op == PlanOpStruct)
+		{
+			for (uint32_t e = 0; e < n; e++)
+			{
+				if (!Run(k + 1, s.end, data, p, last, SlotValues, out)) return false;
+			}
+			k = s.end;
+			continue;
+		}
+
+		for (uint32_t e = 0; e < n; e++)
+		{
+			PlanValue v;
+			size_t available = last - p;
+
+			v.property = s.property;
+			v.step = (uint16_t)k;
+			v.length = s.length;
+			v.size = 0;
+			v.data = p;
+			v.text = PLAN_NO_TEXT;
+			v.TextLength = 0;
+
+			switch (s.op)
+			{
+			case PlanOpFixed:
+				v.size = s.size;
+				break;
+
+			case PlanOpBinary:
+				if (s.LengthSlot != PLAN_NO_SLOT) v.length = (uint16_t)SlotValues[s.LengthSlot];
+				v.size = v.length;
+				break;
+
+			case PlanOpUnicodeString:
+				//up to and including the terminator, or to the end of UserData
+				if (available < 2) return false;
+				while (v.size + 1 < available && (p[v.size] | p[v.size + 1]) != 0) v.size += 2;
+				v.size = v.size + 1 < available ? v.size + 2 : v.size;
+				break;
+
+			case PlanOpAnsiString:
+				if (available < 1) return false;
+				while (v.size < available && p[v.size] != 0) v.size++;
+				if (v.size < available) v.size++;
+				break;
+			}
+
+			if (available < v.size) return false;
+			if (s.slot != PLAN_NO_SLOT) SlotValues[s.slot] = (uint32_t)ReadUnsigned(p, s.size);
+			if (s.format != PlanFormatTdh) FormatValue(s, v, out);
+
+			out.values.push_back(v);
+			p += v.size;
+		}
+
+		k++;
+	}
+
+	return true;
+}
+
+bool DecodePlan::Execute(const uint8_t * data, uint32_t length, DecodeOutput & out) const
+{
+	uint32_t SlotValues[PLAN_MAX_SLOTS];
+	size_t values = out.values.size();
+	size_t text = out.text.size();
+	const uint8_t * p = data;
+
+	if (length < FixedSize) return false;
+
+	memset(SlotValues, 0, sizeof(SlotValues));
+	if (!Run(0, (uint32_t)steps.size(), data, p, data + length, SlotValues, out))
+	{
+		out.values.resize(values);
+		out.text.resize(text);
+		return false;
+	}
+	return true;
+}
+
+/* ****** TRACE_EVENT_INFO ****** */
+
+//Offsets in TRACE_EVENT_INFO and EVENT_PROPERTY_INFO
+#define EVENT_INFO_PROPERTY_COUNT 100
+#define EVENT_INFO_TOP_LEVEL_COUNT 104
+#define EVENT_INFO_PROPERTIES 112
+#define EVENT_PROPERTY_SIZE 24
+#define EVENT_PROPERTY_FLAGS 0
+#define EVENT_PROPERTY_TYPE 8 //InType or StructStartIndex
+#define EVENT_PROPERTY_OUT_TYPE 10 //OutType or NumOfStructMembers
+#define EVENT_PROPERTY_MAP_NAME 12
+#define EVENT_PROPERTY_COUNT 16
+#define EVENT_PROPERTY_LENGTH 18
+
+bool ReadEventInfo(const uint8_t * info, size_t length, std::vector<PlanProperty> & properties, uint32_t * TopLevelCount)
+{
+	uint32_t count;
+	bool ok = true;
+
+	properties.clear();
+	if (length < EVENT_INFO_PROPERTIES) return false;
+
+	count = (uint32_t)ReadUnsigned(info + EVENT_INFO_PROPERTY_COUNT, 4);
+	*TopLevelCount = (uint32_t)ReadUnsigned(info + EVENT_INFO_TOP_LEVEL_COUNT, 4);
+	if (count > 0xFFFF || *TopLevelCount > count) return false;
+	if ((length - EVENT_INFO_PROPERTIES) / EVENT_PROPERTY_SIZE < count) return false;
+
+	properties.resize(count);
+	for (uint32_t i = 0; i < count && ok; i++)
+	{
+		const uint8_t * p = info + EVENT_INFO_PROPERTIES + i * EVENT_PROPERTY_SIZE;
+		PlanProperty & prop = properties[i];
+
+		prop.flags = (uint32_t)ReadUnsigned(p + EVENT_PROPERTY_FLAGS, 4);
+		prop.InType = (uint16_t)ReadUnsigned(p + EVENT_PROPERTY_TYPE, 2);
+		prop.OutType = (uint16_t)ReadUnsigned(p + EVENT_PROPERTY_OUT_TYPE, 2);
+		prop.map = ReadUnsigned(p + EVENT_PROPERTY_MAP_NAME, 4) != 0;
+		prop.StructStart = prop.InType;
+		prop.StructMembers = prop.OutType;
+		prop.count = (uint16_t)ReadUnsigned(p + EVENT_PROPERTY_COUNT, 2);
+		prop.length = (uint16_t)ReadUnsigned(p + EVENT_PROPERTY_LENGTH, 2);
+
+		if ((prop.flags & PLAN_PROPERTY_STRUCT) != 0)
+		{
+			//the union holds the members, not the types
+			prop.InType = 0;
+			prop.OutType = 0;
+			prop.map = false;
+			if ((uint32_t)prop.StructStart + prop.StructMembers > count) ok = false;
+		}
+		else
+		{
+			prop.StructStart = 0;
+			prop.StructMembers = 0;
+		}
+		if ((prop.flags & PLAN_PROPERTY_PARAM_COUNT) != 0 && prop.count >= count) ok = false;
+		if ((prop.flags & PLAN_PROPERTY_PARAM_LENGTH) != 0 && prop.length >= count) ok = false;
+	}
+
+	if (!ok) properties.clear();
+	return ok;
+}
+
+/* ****** Cache ****** */
+
+bool PlanKey::operator==(const PlanKey & other) const
+{
+	return memcmp(provider, other.provider, sizeof(provider)) == 0 && id == other.id &&
+		version == other.version && opcode == other.opcode && PointerSize == other.PointerSize;
+}
+
+size_t PlanKeyHash::operator()(const PlanKey & key) const
+{
+	uint32_t h = 2166136261U;
+
+	for (int i = 0; i < 16; i++) h = (h ^ key.provider[i]) * 16777619U;
+	h = (h ^ key.id) * 16777619U;
+	h = (h ^ key.version) * 16777619U;
+	h = (h ^ key.opcode) * 16777619U;
+	h = (h ^ key.PointerSize) * 16777619U;
+	return h;
+}
+
+DecodePlanCache::~DecodePlanCache()
+{
+	Clear();
+}
+
+bool DecodePlanCache::Find(const PlanKey & key, DecodePlan ** plan) const
+{
+	std::unordered_map<PlanKey, DecodePlan *, PlanKeyHash>::const_iterator it = plans.find(key);
+
+	if (it == plans.end()) return false;
+	*plan = it->second;
+	return true;
+}
+
+void DecodePlanCache::Add(const PlanKey & key, DecodePlan * plan)
+{
+	DecodePlan * & slot = plans[key];
+
+	if (slot != NULL && slot != plan) delete slot;
+	slot = plan;
+}
+
+void DecodePlanCache::Clear()
+{
+	for (std::unordered_map<PlanKey, DecodePlan *, PlanKeyHash>::iterator it = plans.begin(); it != plans.end(); ++it)
+	{
+		delete it->second;
+	}
+	plans.clear();
+}
+
+} // END NAMESPACE
@@ -0,0 +1,215 @@
+//Precompiled decoding plans for events described by TDH schemas
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <unordered_map>
+
+namespace EtwNetwork
+{
+
+//Property in types and out types, same values as TDH_INTYPE_* and TDH_OUTTYPE_*
+#define PLAN_INTYPE_UNICODESTRING 1
+#define PLAN_INTYPE_ANSISTRING 2
+#define PLAN_INTYPE_INT8 3
+#define PLAN_INTYPE_UINT8 4
+#define PLAN_INTYPE_INT16 5
+#define PLAN_INTYPE_UINT16 6
+#define PLAN_INTYPE_INT32 7
+#define PLAN_INTYPE_UINT32 8
+#define PLAN_INTYPE_INT64 9
+#define PLAN_INTYPE_UINT64 10
+#define PLAN_INTYPE_FLOAT 11
+#define PLAN_INTYPE_DOUBLE 12
+#define PLAN_INTYPE_BOOLEAN 13
+#define PLAN_INTYPE_BINARY 14
+#define PLAN_INTYPE_GUID 15
+#define PLAN_INTYPE_POINTER 16
+#define PLAN_INTYPE_FILETIME 17
+#define PLAN_INTYPE_SYSTEMTIME 18
+#define PLAN_INTYPE_HEXINT32 20
+#define PLAN_INTYPE_HEXINT64 21
+#define PLAN_INTYPE_UNICODECHAR 22
+#define PLAN_INTYPE_ANSICHAR 23
+#define PLAN_INTYPE_SIZET 24
+
+#define PLAN_OUTTYPE_NULL 0
+#define PLAN_OUTTYPE_STRING 1
+#define PLAN_OUTTYPE_BYTE 3
+#define PLAN_OUTTYPE_UNSIGNEDBYTE 4
+#define PLAN_OUTTYPE_SHORT 5
+#define PLAN_OUTTYPE_UNSIGNEDSHORT 6
+#define PLAN_OUTTYPE_INT 7
+#define PLAN_OUTTYPE_UNSIGNEDINT 8
+#define PLAN_OUTTYPE_LONG 9
+#define PLAN_OUTTYPE_UNSIGNEDLONG 10
+#define PLAN_OUTTYPE_GUID 14
+#define PLAN_OUTTYPE_HEXINT8 16
+#define PLAN_OUTTYPE_HEXINT16 17
+#define PLAN_OUTTYPE_HEXINT32 18
+#define PLAN_OUTTYPE_HEXINT64 19
+#define PLAN_OUTTYPE_PID 20
+#define PLAN_OUTTYPE_TID 21
+#define PLAN_OUTTYPE_PORT 22
+#define PLAN_OUTTYPE_IPV4 23
+#define PLAN_OUTTYPE_IPV6 24
+
+//Property flags, same values as PROPERTY_FLAGS
+#define PLAN_PROPERTY_STRUCT 0x1
+#define PLAN_PROPERTY_PARAM_LENGTH 0x2
+#define PLAN_PROPERTY_PARAM_COUNT 0x4
+#define PLAN_PROPERTY_XML_FRAGMENT 0x8
+#define PLAN_PROPERTY_CUSTOM_SCHEMA 0x80
+
+#define PLAN_DYNAMIC 0xFFFFFFFF //offset not known until the event is decoded
+#define PLAN_NO_SLOT 0xFF
+#define PLAN_NO_TEXT 0xFFFFFFFF
+#define PLAN_MAX_SLOTS 32
+
+// Property of the event schema, the platform-independent part of EVENT_PROPERTY_INFO.
+// Index fields refer to other entries of the same property table.
+
+struct PlanProperty
+{
+	uint32_t flags; //PLAN_PROPERTY_*
+	uint16_t InType;
+	uint16_t OutType;
+	bool map; //value has a name/value map
+	uint16_t StructStart; //PLAN_PROPERTY_STRUCT: first member
+	uint16_t StructMembers; //PLAN_PROPERTY_STRUCT: number of members
+	uint16_t count; //countPropertyIndex when PLAN_PROPERTY_PARAM_COUNT is set
+	uint16_t length; //lengthPropertyIndex when PLAN_PROPERTY_PARAM_LENGTH is set
+};
+
+enum PlanOp
+{
+	PlanOpFixed = 0, //value of a fixed size
+	PlanOpBinary = 1, //blob, the length is fixed or taken from a slot
+	PlanOpUnicodeString = 2, //null-terminated UTF-16 string
+	PlanOpAnsiString = 3, //null-terminated ANSI string
+	PlanOpStruct = 4 //structure, the members are the steps up to "end"
+};
+
+enum PlanFormat
+{
+	PlanFormatTdh = 0, //formatted by the caller with TdhFormatProperty
+	PlanFormatSigned = 1,
+	PlanFormatUnsigned = 2,
+	PlanFormatHex = 3,
+	PlanFormatPort = 4, //UINT16 in network byte order
+	PlanFormatIpv4 = 5,
+	PlanFormatGuid = 6,
+	PlanFormatString = 7
+};
+
+struct PlanStep
+{
+	uint16_t property; //index in the property table
+	uint8_t op; //PlanOp
+	uint8_t format; //PlanFormat
+	uint16_t InType;
+	uint16_t OutType;
+	uint16_t length; //property length passed to TDH, fixed blob length for PlanOpBinary
+	uint16_t count; //fixed number of elements
+	uint8_t size; //size of one element of PlanOpFixed
+	uint8_t slot; //slot receiving the value for later length/count references, or PLAN_NO_SLOT
+	uint8_t LengthSlot; //slot holding the length, or PLAN_NO_SLOT if fixed
+	uint8_t CountSlot; //slot holding the count, or PLAN_NO_SLOT if fixed
+	uint32_t offset; //offset of the value in UserData, or PLAN_DYNAMIC
+	uint32_t end; //PlanOpStruct: index of the first step after the members
+};
+
+//Property value produced by the plan
+struct PlanValue
+{
+	uint16_t property; //index in the property table
+	uint16_t step;
+	uint16_t length; //property length to pass to TDH
+	uint32_t size; //bytes of UserData taken by the value
+	const uint8_t * data;
+	uint32_t text; //offset of the formatted value in DecodeOutput::text, PLAN_NO_TEXT if the caller has to format it
+	uint32_t TextLength; //UTF-16 units
+};
+
+struct DecodeOutput
+{
+	std::vector<PlanValue> values;
+	std::vector<uint16_t> text; //UTF-16 formatted values, not null-terminated
+
+	void Clear() { values.clear(); text.clear(); }
+};
+
+// Flat decoding plan compiled once per event schema: properties in the order they appear in UserData,
+// structures expanded, length and count references resolved to slots, and offsets computed up to the
+// first value of variable size. Executing the plan reads UserData directly; only values the interpreter
+// can't format itself (maps, floating point, time and other rare types) are left to TdhFormatProperty.
+
+class DecodePlan
+{
+public:
+	std::vector<PlanStep> steps;
+	uint32_t FixedSize; //bytes of UserData at fixed offsets
+	uint32_t PointerSize;
+	std::vector<uint8_t> schema; //copy of the TRACE_EVENT_INFO the plan was compiled from, kept for TDH
+
+	DecodePlan();
+
+	//Returns false if the schema has properties the plan can't decode; such events take the TDH path
+	bool Compile(const PlanProperty * properties, uint32_t count, uint32_t TopLevelCount, uint32_t PointerSize);
+
+	//Appends values of all properties to "out". Returns false if UserData doesn't match the schema
+	bool Execute(const uint8_t * data, uint32_t length, DecodeOutput & out) const;
+
+private:
+	const PlanProperty * properties;
+	uint32_t PropertyCount;
+	std::vector<uint8_t> SlotOf; //property index -> slot
+	std::vector<bool> emitted;
+	uint32_t slots;
+
+	bool CompileProperty(uint16_t i, uint32_t & offset, uint32_t depth);
+	bool Run(uint32_t begin, uint32_t end, const uint8_t * data, const uint8_t * & p, const uint8_t * last,
+		uint32_t * SlotValues, DecodeOutput & out) const;
+};
+
+// Fills "properties" from a TRACE_EVENT_INFO as returned by TdhGetEventInformation (the layout is the same
+// in 32 and 64-bit processes), so plans can be compiled from a saved schema without TDH. Returns false if the
+// buffer is too short for its property table or a property refers to one that doesn't exist.
+bool ReadEventInfo(const uint8_t * info, size_t length, std::vector<PlanProperty> & properties, uint32_t * TopLevelCount);
+
+//Identifies an event schema
+struct PlanKey
+{
+	uint8_t provider[16];
+	uint16_t id;
+	uint8_t version;
+	uint8_t opcode;
+	uint32_t PointerSize;
+
+	bool operator==(const PlanKey & other) const;
+};
+
+struct PlanKeyHash
+{
+	size_t operator()(const PlanKey & key) const;
+};
+
+// Plans of the schemas seen so far. A schema that failed to compile is remembered with a NULL plan.
+// Not thread-safe.
+
+class DecodePlanCache
+{
+public:
+	~DecodePlanCache();
+
+	bool Find(const PlanKey & key, DecodePlan ** plan) const; //returns false if the schema was not seen yet
+	void Add(const PlanKey & key, DecodePlan * plan); //takes ownership of the plan
+	void Clear();
+	size_t Count() const { return plans.size(); }
+
+private:
+	std::unordered_map<PlanKey, DecodePlan *, PlanKeyHash> plans;
+};
+
+} // END NAMESPACE
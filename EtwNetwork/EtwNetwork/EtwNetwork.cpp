@@ -19,6 +19,17 @@
 #include <tdh.h>
 #include <in6addr.h>
 
+#include <vector>
+
+#include "NetRecord.h"
+#include "Sampling.h"
+#include "HistoryStore.h"
+#include "AnomalyDetector.h"
+#include "DecodePlan.h"
+#include "Coalescer.h"
+#include "SharedRing.h"
+#include "NetBatch.h"
+
 #pragma comment(lib, "Advapi32.lib")
 #pragma comment(lib, "Ole32.lib")
 #pragma comment(lib, "tdh.lib")
@@ -73,11 +84,16 @@ public:
 	System::Int32 version;
 	System::Int32 type;
 	System::DateTime timestamp;
+	System::UInt32 weight; //number of original events this one stands for when sampling is active
+	System::UInt32 count; //number of send/receive events of a connection merged into this one when coalescing is on
+	System::DateTime LastTimestamp; //time of the last merged event
 	System::Collections::Generic::List<EtwEventProperty ^> ^ properties;
 
 	EtwEvent()
 	{
 		properties = gcnew System::Collections::Generic::List<EtwEventProperty ^>(15);
+		weight = 1;
+		count = 1;
 	}
 
 	virtual  System::String ^ ToString() override {
@@ -87,6 +103,8 @@ public:
 		sb->AppendLine("Version: "+version.ToString());
 		sb->AppendLine("Type: "+type.ToString());
 		sb->AppendLine("Time: "+timestamp.ToString());
+		if(weight != 1) sb->AppendLine("Weight: "+weight.ToString());
+		if(count != 1) sb->AppendLine("Count: "+count.ToString()+" (last at "+LastTimestamp.ToString()+")");
 
 		for each (EtwEventProperty^ prop in properties)
 		{
@@ -99,6 +117,13 @@ public:
 
 public delegate void EventDelegate( System::Object^ sender, EtwEvent^ e );
 
+public enum class SamplingModes //what is done when events arrive faster than they can be processed
+{
+	Off = SamplingOff, //process every event, ETW drops buffers on overload
+	PerEvent = SamplingPerEvent, //keep send/receive events independently of each other
+	PerFlow = SamplingPerFlow //keep or drop all send/receive events of a connection together
+};
+
 
 /* Function forward declarations */
 DWORD GetEventInformation(PEVENT_RECORD pEvent, PTRACE_EVENT_INFO & pInfo);
@@ -107,6 +132,14 @@ DWORD GetPropertyLength(PEVENT_RECORD pEvent, PTRACE_EVENT_INFO pInfo, USHORT i,
 DWORD GetArraySize(PEVENT_RECORD pEvent, PTRACE_EVENT_INFO pInfo, USHORT i, PUSHORT ArraySize);
 DWORD GetMapInfo(PEVENT_RECORD pEvent, LPWSTR pMapName, DWORD DecodingSource, PEVENT_MAP_INFO & pMapInfo);
 void RemoveTrailingSpace(PEVENT_MAP_INFO pMapInfo);
+BOOL DecodeNetEvent(PEVENT_RECORD pEvent, NetRecord * rec);
+DecodePlan * GetDecodePlan(PEVENT_RECORD pEvent, DWORD PointerSize);
+void AddPlanProperties(PEVENT_RECORD pEvent, PTRACE_EVENT_INFO pInfo, DWORD PointerSize, EtwEvent ^ ev);
+System::String ^ FormatPropertyValue(PEVENT_RECORD pEvent, PTRACE_EVENT_INFO pInfo, DWORD PointerSize, USHORT i,
+	USHORT PropertyLength, PBYTE pUserData, PBYTE pEndOfUserData);
+DWORD SampleNetEvent(PEVENT_RECORD pEvent, const NetRecord * rec);
+void CollectCoalesced(const CoalescedRecord & rec, void * context);
+void RaiseCoalesced();
 VOID WINAPI EventCallback(PEVENT_RECORD pEvent);
 BOOL WINAPI BufferEventCallback(PEVENT_TRACE_LOGFILE buf);
 
@@ -492,7 +525,17 @@ cleanup:
 //global varaibles
 TRACEHANDLE SessionHandle = 0;
 EVENT_TRACE_PROPERTIES* pSessionProperties = NULL;
+EVENT_TRACE_PROPERTIES* pQueryProperties = NULL; //used to poll the state of session buffers
 volatile BOOL fStop;
+AdaptiveSampler Sampler;
+LARGE_INTEGER QpcFrequency;
+DWORD ProcessorCount = 1; //each processor fills its own session buffer
+DecodePlanCache DecodePlans; //plans of the schemas decoded through TDH
+DecodeOutput PlanOutput;
+bool fDecodePlans = true;
+FlowCoalescer Coalescer;
+std::vector<CoalescedRecord> CoalescedOut; //records emitted by Coalescer, waiting to be raised
+bool fCoalesce = false;
 
 public ref class EtwSession 
 {
@@ -505,12 +548,111 @@ public:
 		NewEvent(gcnew System::Object(),e);
 	}
 
+	/* Overload handling */
+
+	//Specifies how events are sampled when the session falls behind. Can be changed while the session is running
+	static property SamplingModes SamplingMode
+	{
+		SamplingModes get(){ return (SamplingModes)Sampler.mode; }
+		void set(SamplingModes value){ Sampler.mode = (EtwNetwork::SamplingMode)value; }
+	}
+
+	//Current sampling period: 1 of SamplingPeriod events (or flows) is passed to NewEvent with weight = SamplingPeriod
+	static property System::UInt32 SamplingPeriod
+	{
+		System::UInt32 get(){ return Sampler.period; }
+	}
+
+	//Upper bound of SamplingPeriod, rounded down to the power of 2
+	static property System::UInt32 MaxSamplingPeriod
+	{
+		System::UInt32 get(){ return Sampler.MaxPeriod; }
+		void set(System::UInt32 value){
+			if(value == 0) throw gcnew System::ArgumentOutOfRangeException("value");
+			System::UInt32 p = 1;
+			while(p <= value / 2) p *= 2;
+			Sampler.MaxPeriod = p;
+			if (Sampler.period > p) Sampler.period = p; //takes effect now rather than after the load drops
+		}
+	}
+
+	//Sampling is increased when events are delivered later than this after they were logged
+	static property System::UInt32 MaxLagMilliseconds
+	{
+		System::UInt32 get(){ return (System::UInt32)(Sampler.MaxLag / 10000); }
+		void set(System::UInt32 value){ Sampler.MaxLag = (uint64_t)value * 10000; }
+	}
+
+	//Sampling is increased when the event callback takes more than this percentage of wall time
+	static property System::UInt32 MaxCallbackLoad
+	{
+		System::UInt32 get(){ return Sampler.MaxLoad; }
+		void set(System::UInt32 value){ Sampler.MaxLoad = value; }
+	}
+
+	//Sampling is increased when more than this percentage of session buffers are waiting for delivery
+	static property System::UInt32 MaxQueueLoad
+	{
+		System::UInt32 get(){ return Sampler.MaxQueue; }
+		void set(System::UInt32 value){ Sampler.MaxQueue = value; }
+	}
+
+	//Send and receive events seen by the sampler and passed on by it
+	static property System::UInt64 EventsSeen { System::UInt64 get(){ return Sampler.EventsSeen; } }
+	static property System::UInt64 EventsSampled { System::UInt64 get(){ return Sampler.EventsSampled; } }
+
+	//Events and buffers lost by ETW before they reached this process
+	static property System::UInt64 EventsLost { System::UInt64 get(){ return Sampler.EventsLost; } }
+
+	/* Decoding */
+
+	//Decode event properties with plans compiled once per event schema instead of querying TDH for every property
+	static property System::Boolean PrecompiledDecoding
+	{
+		System::Boolean get(){ return fDecodePlans; }
+		void set(System::Boolean value){ fDecodePlans = value; }
+	}
+
+	/* Coalescing */
+
+	// Merges consecutive send/receive events of a connection into one event with the summed size and
+	// EtwEvent::count set to the number of merged events. Other events of the connection are passed
+	// right after the merged event preceding them. Can be changed while the session is running.
+	// Merged events have the properties of the first merged event, except startime and endtime of TCP sends.
+	static property System::Boolean Coalescing
+	{
+		System::Boolean get(){ return fCoalesce; }
+		void set(System::Boolean value){ fCoalesce = value; }
+	}
+
+	// Longest time between the first and the last event merged into one. When a connection goes quiet, its
+	// merged event is raised up to this window plus the session flush delay (1 s) after its first event.
+	static property System::UInt32 CoalesceWindowMilliseconds
+	{
+		System::UInt32 get(){ return (System::UInt32)(Coalescer.window / 10000); }
+		void set(System::UInt32 value){ Coalescer.window = (uint64_t)value * 10000; }
+	}
+
+	//Most events merged into one, 0 = no limit
+	static property System::UInt32 CoalesceMaxEvents
+	{
+		System::UInt32 get(){ return Coalescer.MaxEvents; }
+		void set(System::UInt32 value){ Coalescer.MaxEvents = value; }
+	}
+
+	//Send and receive events taken by the coalescing stage and merged events raised for them
+	static property System::UInt64 EventsCoalesced { System::UInt64 get(){ return Coalescer.EventsIn; } }
+	static property System::UInt64 RecordsCoalesced { System::UInt64 get(){ return Coalescer.RecordsOut; } }
+
 static void Start(){
 
 	if(started == true)return;
     ULONG status = ERROR_SUCCESS;  
     ULONG BufferSize = 0;
 	EVENT_TRACE_LOGFILE trace={0};	
+	LARGE_INTEGER seed;
+	FILETIME now;
+	SYSTEM_INFO sysinfo;
 	fStop = FALSE;
 
     // Allocate memory for the session properties.
@@ -533,9 +675,32 @@ static void Start(){
     pSessionProperties->Wnode.Guid = SystemTraceControlGuid; 
     pSessionProperties->EnableFlags = EVENT_TRACE_FLAG_NETWORK_TCPIP;
     pSessionProperties->LogFileMode = EVENT_TRACE_REAL_TIME_MODE;    
+    pSessionProperties->FlushTimer = 1; //seconds; the sampler discounts this delay from the lag
     pSessionProperties->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
     pSessionProperties->LogFileNameOffset = 0; 
 
+	// Allocate the buffer used to query the session state for overload detection.
+
+	pQueryProperties = (EVENT_TRACE_PROPERTIES*) malloc(BufferSize);
+	if (NULL == pQueryProperties)
+	{
+		status = E_OUTOFMEMORY;
+		goto cleanup;
+	}
+
+	QueryPerformanceFrequency(&QpcFrequency);
+	GetSystemInfo(&sysinfo);
+	ProcessorCount = sysinfo.dwNumberOfProcessors;
+	QueryPerformanceCounter(&seed);
+	GetSystemTimeAsFileTime(&now);
+	Sampler.Reset((uint64_t)seed.QuadPart * 0x9E3779B97F4A7C15ULL,
+		((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime);
+	Sampler.FlushDelay = (uint64_t)pSessionProperties->FlushTimer * 10000000;
+
+	Coalescer.Clear();
+	Coalescer.callback = CollectCoalesced;
+	Coalescer.context = &CoalescedOut;
+
 
     // Create the trace session.
 
@@ -580,6 +745,11 @@ cleanup:
 
     Destroy();
 
+	// Pass on the events still held by the coalescing stage.
+
+	Coalescer.Flush();
+	RaiseCoalesced();
+
 	if(status != ERROR_SUCCESS && status != ERROR_CANCELLED){
 		throw gcnew System::ComponentModel::Win32Exception(status);
 	}
@@ -602,6 +772,11 @@ static void Destroy(){
         free(pSessionProperties);
 		pSessionProperties = NULL;
 	}
+
+	if (pQueryProperties){
+		free(pQueryProperties);
+		pQueryProperties = NULL;
+	}
 	started = false;
 
 	if(status != ERROR_SUCCESS){
@@ -613,6 +788,970 @@ static void Destroy(){
 /* ************ end EtwSession ************ */
 
 
+/* ************ Events from records ************ */
+
+//Local time truncated to milliseconds, the way EventCallback sets EtwEvent::timestamp
+System::DateTime EventTime(uint64_t FileTime)
+{
+	FILETIME ft;
+	SYSTEMTIME st;
+	SYSTEMTIME stLocal;
+
+	ft.dwHighDateTime = (DWORD)(FileTime >> 32);
+	ft.dwLowDateTime = (DWORD)FileTime;
+	FileTimeToSystemTime(&ft, &st);
+	SystemTimeToTzSpecificLocalTime(NULL, &st, &stLocal);
+
+	return System::DateTime(stLocal.wYear, stLocal.wMonth, stLocal.wDay,
+		stLocal.wHour, stLocal.wMinute, stLocal.wSecond, (int)((FileTime % 10000000) / 10000));
+}
+
+System::String ^ FormatAddress(const uint8_t * addr, bool ip6)
+{
+	array<System::Byte> ^ bytes = gcnew array<System::Byte>(ip6 ? 16 : 4);
+	for (int i = 0; i < bytes->Length; i++) bytes[i] = addr[i];
+	return (gcnew System::Net::IPAddress(bytes))->ToString();
+}
+
+void AddProperty(EtwEvent ^ ev, System::String ^ name, System::String ^ value)
+{
+	EtwEventProperty ^ prop = gcnew EtwEventProperty();
+	prop->name = name;
+	prop->value = value;
+	ev->properties->Add(prop);
+}
+
+// Restores the event in the form EventCallback produces it: the properties shared by all TcpIp/UdpIp events,
+// then seqnum and connid formatted as TDH does, when they are known.
+
+EtwEvent ^ EventFromRecord(const NetRecord & rec, const NetConnection * conn)
+{
+	const GUID & g = rec.proto == NET_PROTO_UDP ? UdpIpEventGuid : TcpIpEventGuid;
+	EtwEvent ^ ev = gcnew EtwEvent();
+
+	ev->guid = System::Guid(g.Data1, g.Data2, g.Data3, g.Data4[0], g.Data4[1], g.Data4[2],
+		g.Data4[3], g.Data4[4], g.Data4[5], g.Data4[6], g.Data4[7]);
+	ev->version = 2;
+	ev->type = rec.opcode;
+	ev->timestamp = EventTime(rec.timestamp);
+	ev->LastTimestamp = ev->timestamp;
+	ev->weight = rec.weight;
+	AddProperty(ev, "PID", rec.pid.ToString());
+	AddProperty(ev, "size", rec.size.ToString());
+	AddProperty(ev, "daddr", FormatAddress(rec.daddr, rec.ip6 != 0));
+	AddProperty(ev, "saddr", FormatAddress(rec.saddr, rec.ip6 != 0));
+	AddProperty(ev, "dport", rec.dport.ToString());
+	AddProperty(ev, "sport", rec.sport.ToString());
+	if (conn != NULL)
+	{
+		AddProperty(ev, "seqnum", conn->seqnum.ToString());
+		AddProperty(ev, "connid", "0x" + conn->connid.ToString("X"));
+	}
+	return ev;
+}
+
+void CollectCoalesced(const CoalescedRecord & rec, void * context)
+{
+	((std::vector<CoalescedRecord> *)context)->push_back(rec);
+}
+
+//Raises the merged events emitted by the coalescing stage
+void RaiseCoalesced()
+{
+	try
+	{
+		for (size_t i = 0; i < CoalescedOut.size(); i++)
+		{
+			const CoalescedRecord & r = CoalescedOut[i];
+			EtwEvent ^ ev = EventFromRecord(r.rec, r.HasConnection ? &r.conn : NULL);
+
+			ev->version = r.version;
+			ev->count = r.events;
+			ev->LastTimestamp = EventTime(r.LastTimestamp);
+			EtwSession::OnNewEvent(ev);
+		}
+	}
+	finally
+	{
+		CoalescedOut.clear();
+	}
+}
+/* ************ end Events from records ************ */
+
+
+/* ************ Event stages ************ */
+
+// EtwHistory, EtwTraffic, EtwAnomalies and EtwPublisher are fed every decoded event. They share one lock,
+// so EventCallback takes it once per event for all of them rather than once per stage; their internal
+// methods are called with it held.
+ref class EtwStages
+{
+internal:
+	static System::Object ^ sync = gcnew System::Object();
+
+	static void Process(const NetRecord & rec); //defined after the stages
+};
+/* ************ end Event stages ************ */
+
+
+/* ************ EtwHistory ************ */
+
+struct HistoryQueryContext
+{
+	std::vector<NetRecord> found;
+	size_t MaxResults;
+};
+
+struct HistoryTotalsContext
+{
+	uint64_t sent;
+	uint64_t recv;
+};
+
+bool CollectHistoryRecord(const NetRecord & rec, void * context)
+{
+	HistoryQueryContext * q = (HistoryQueryContext *)context;
+	q->found.push_back(rec);
+	return q->found.size() < q->MaxResults;
+}
+
+bool SumHistoryRecord(const NetRecord & rec, void * context)
+{
+	HistoryTotalsContext * t = (HistoryTotalsContext *)context;
+	if (NetOpcodeIsSend(rec.opcode)) t->sent += (uint64_t)rec.size * rec.weight;
+	else if (NetOpcodeIsRecv(rec.opcode)) t->recv += (uint64_t)rec.size * rec.weight;
+	return true;
+}
+
+//Compressed history of TCP/IP events passed by EtwSession. Holds far more events than a list of EtwEvent objects
+public ref class EtwHistory
+{
+	static System::Object ^ sync = EtwStages::sync; //shared by the stages, see EtwStages
+	static HistoryStore * store = NULL;
+
+	static void SetFilter(HistoryFilter & filter, System::DateTime from, System::DateTime to, System::Int32 pid, System::Int32 port)
+	{
+		if (from > System::DateTime::FromFileTime(0)) filter.from = (uint64_t)from.ToFileTime();
+		if (to < System::DateTime::MaxValue) filter.to = (uint64_t)to.ToFileTime();
+		if (pid >= 0) { filter.pid = (uint32_t)pid; filter.AnyPid = false; }
+		if (port > 0) filter.port = (uint16_t)port;
+	}
+
+public:
+
+	// Starts recording events into the history. The oldest events are dropped to keep MemoryUsage near MaxBytes,
+	// which is a budget rather than a hard limit. The floor is the open segment (up to 1/8 of MaxBytes, at least
+	// 1024 events) plus the newest sealed one. Connections are stored once for the whole history, so bytes per
+	// event grow with the number of distinct flows.
+	static void Enable(System::Int64 MaxBytes)
+	{
+		if (MaxBytes <= 0) throw gcnew System::ArgumentOutOfRangeException("MaxBytes");
+
+		System::Threading::Monitor::Enter(sync);
+		try
+		{
+			if (store == NULL) store = new HistoryStore((size_t)MaxBytes);
+			else store->MaxBytes = (size_t)MaxBytes;
+		}
+		finally
+		{
+			System::Threading::Monitor::Exit(sync);
+		}
+	}
+
+	//Stops recording and frees the history
+	static void Disable()
+	{
+		System::Threading::Monitor::Enter(sync);
+		try
+		{
+			delete store;
+			store = NULL;
+		}
+		finally
+		{
+			System::Threading::Monitor::Exit(sync);
+		}
+	}
+
+	static property System::Boolean Enabled { System::Boolean get(){ return store != NULL; } }
+
+	static property System::UInt64 EventCount
+	{
+		System::UInt64 get(){
+			System::Threading::Monitor::Enter(sync);
+			try { return store != NULL ? store->EventCount() : 0; }
+			finally { System::Threading::Monitor::Exit(sync); }
+		}
+	}
+
+	static property System::Int64 MemoryUsage
+	{
+		System::Int64 get(){
+			System::Threading::Monitor::Enter(sync);
+			try { return store != NULL ? (System::Int64)store->MemoryUsage() : 0; }
+			finally { System::Threading::Monitor::Exit(sync); }
+		}
+	}
+
+	static void Clear()
+	{
+		System::Threading::Monitor::Enter(sync);
+		try { if (store != NULL) store->Clear(); }
+		finally { System::Threading::Monitor::Exit(sync); }
+	}
+
+	// Returns up to MaxResults stored events in the time range [from, to), oldest first.
+	// The history keeps the fields shared by all TcpIp/UdpIp events; seqnum, connid and the rest are not stored.
+	// pid = -1 and port = 0 match any process and port.
+
+	static System::Collections::Generic::List<EtwEvent ^> ^ Query(System::DateTime from, System::DateTime to,
+		System::Int32 pid, System::Int32 port, System::Int32 MaxResults)
+	{
+		HistoryFilter filter;
+		HistoryQueryContext query;
+		System::Collections::Generic::List<EtwEvent ^> ^ res;
+
+		if (MaxResults <= 0) throw gcnew System::ArgumentOutOfRangeException("MaxResults");
+		SetFilter(filter, from, to, pid, port);
+		query.MaxResults = (size_t)MaxResults;
+
+		System::Threading::Monitor::Enter(sync);
+		try { if (store != NULL) store->Scan(filter, CollectHistoryRecord, &query); }
+		finally { System::Threading::Monitor::Exit(sync); }
+
+		res = gcnew System::Collections::Generic::List<EtwEvent ^>((int)query.found.size());
+		for (size_t i = 0; i < query.found.size(); i++) res->Add(EventFromRecord(query.found[i], NULL));
+		return res;
+	}
+
+	//Sums weighted sent and received bytes of stored events without materializing them. Returns the number of matched events
+	static System::UInt64 GetTotals(System::DateTime from, System::DateTime to, System::Int32 pid, System::Int32 port,
+		[System::Runtime::InteropServices::Out] System::Int64 % SentBytes,
+		[System::Runtime::InteropServices::Out] System::Int64 % RecvBytes)
+	{
+		HistoryFilter filter;
+		HistoryTotalsContext totals = {0, 0};
+		uint64_t n = 0;
+
+		SetFilter(filter, from, to, pid, port);
+
+		System::Threading::Monitor::Enter(sync);
+		try { if (store != NULL) n = store->Scan(filter, SumHistoryRecord, &totals); }
+		finally { System::Threading::Monitor::Exit(sync); }
+
+		SentBytes = (System::Int64)totals.sent;
+		RecvBytes = (System::Int64)totals.recv;
+		return n;
+	}
+
+internal:
+
+	static void Append(const NetRecord & rec)
+	{
+		if (store != NULL) store->Append(rec);
+	}
+};
+/* ************ end EtwHistory ************ */
+
+
+/* ************ EtwTraffic ************ */
+
+//Block of records waiting for the batch kernels and the totals of the blocks already processed
+struct TrafficState
+{
+	NetBatch batch;
+	NetLocalAddresses local;
+	NetBatchTotals totals;
+	uint64_t events;
+};
+
+// Sent and received bytes of the send/receive events passed by EtwSession, weighted by sampling, and the part
+// of them that stayed on this computer. Events are collected into blocks and classified by the batch kernels
+// (NetBatch.h) a block at a time; the block in progress is processed whenever the totals are read.
+
+public ref class EtwTraffic
+{
+	static System::Object ^ sync = EtwStages::sync; //shared by the stages, see EtwStages
+	static TrafficState * state = NULL;
+
+	static void ProcessBlock()
+	{
+		NetBatchProcess(&state->batch, state->local, &state->totals);
+		state->batch.count = 0;
+	}
+
+public:
+
+	// Starts counting from zero. LocalAddresses are the addresses of the local interfaces, as returned by
+	// NetworkStats.GetLocalAddresses; up to 32 IPv4 and 16 IPv6 addresses are used.
+
+	static void Enable(System::Collections::Generic::IEnumerable<System::Net::IPAddress ^> ^ LocalAddresses)
+	{
+		NetLocalAddresses local;
+
+		if (LocalAddresses == nullptr) throw gcnew System::ArgumentNullException("LocalAddresses");
+
+		NetLocalAddressesClear(&local);
+		for each (System::Net::IPAddress ^ addr in LocalAddresses)
+		{
+			array<System::Byte> ^ bytes = addr->GetAddressBytes();
+			pin_ptr<System::Byte> p = &bytes[0];
+			NetLocalAddressesAdd(&local, p, bytes->Length == 16);
+		}
+
+		System::Threading::Monitor::Enter(sync);
+		try
+		{
+			if (state == NULL) state = new TrafficState();
+			state->batch.count = 0;
+			state->local = local;
+			state->totals.SentBytes = 0;
+			state->totals.RecvBytes = 0;
+			state->totals.LocalBytes = 0;
+			state->events = 0;
+		}
+		finally
+		{
+			System::Threading::Monitor::Exit(sync);
+		}
+	}
+
+	//Stops counting and frees the totals
+	static void Disable()
+	{
+		System::Threading::Monitor::Enter(sync);
+		try
+		{
+			delete state;
+			state = NULL;
+		}
+		finally
+		{
+			System::Threading::Monitor::Exit(sync);
+		}
+	}
+
+	static property System::Boolean Enabled { System::Boolean get(){ return state != NULL; } }
+
+	//Returns the number of send/receive events counted since Enable. LocalBytes is part of SentBytes + RecvBytes
+	static System::UInt64 GetTotals([System::Runtime::InteropServices::Out] System::Int64 % SentBytes,
+		[System::Runtime::InteropServices::Out] System::Int64 % RecvBytes,
+		[System::Runtime::InteropServices::Out] System::Int64 % LocalBytes)
+	{
+		NetBatchTotals totals = {0, 0, 0};
+		uint64_t n = 0;
+
+		System::Threading::Monitor::Enter(sync);
+		try
+		{
+			if (state != NULL)
+			{
+				ProcessBlock();
+				totals = state->totals;
+				n = state->events;
+			}
+		}
+		finally
+		{
+			System::Threading::Monitor::Exit(sync);
+		}
+
+		SentBytes = (System::Int64)totals.SentBytes;
+		RecvBytes = (System::Int64)totals.RecvBytes;
+		LocalBytes = (System::Int64)totals.LocalBytes;
+		return n;
+	}
+
+internal:
+
+	static void Add(const NetRecord & rec)
+	{
+		if (state == NULL || !NetOpcodeIsData(rec.opcode)) return;
+
+		if (state->batch.count == NET_BATCH_SIZE) ProcessBlock();
+		NetBatchAppendRecord(&state->batch, rec);
+		state->events++;
+	}
+};
+/* ************ end EtwTraffic ************ */
+
+
+/* ************ EtwAnomalies ************ */
+
+public enum class AnomalyKeyKinds
+{
+	Process = AnomalyKeyProcess, //traffic of one process
+	Subnet = AnomalyKeySubnet, //traffic to one remote /24 (IPv4) or /64 (IPv6) subnet
+	Port = AnomalyKeyPort //traffic to one remote port
+};
+
+public enum class AnomalyMetrics
+{
+	SentBytes = AnomalyMetricSent,
+	RecvBytes = AnomalyMetricRecv,
+	Retransmits = AnomalyMetricRetransmits
+};
+
+public ref class EtwAnomaly //represents traffic rate deviating from its baseline
+{
+public:
+	AnomalyKeyKinds kind;
+	AnomalyMetrics metric;
+	System::Int32 pid; //for AnomalyKeyKinds::Process
+	System::Int32 port; //for AnomalyKeyKinds::Port
+	System::Net::IPAddress ^ subnet; //for AnomalyKeyKinds::Subnet
+	System::DateTime IntervalStart;
+	System::TimeSpan IntervalLength;
+	System::Double value; //observed in the interval
+	System::Double mean; //expected
+	System::Double deviation;
+	System::Double score; //(value - mean) / deviation
+
+	virtual  System::String ^ ToString() override {
+		System::String ^ key;
+		if (kind == AnomalyKeyKinds::Process) key = "PID " + pid.ToString();
+		else if (kind == AnomalyKeyKinds::Port) key = "port " + port.ToString();
+		else key = "subnet " + subnet->ToString();
+		return System::String::Format("{0} | Anomaly: {1} of {2} is {3:F0}, expected {4:F0} (score {5:F1})",
+			IntervalStart, metric, key, value, mean, score);
+	}
+};
+
+public delegate void AnomalyDelegate( System::Object^ sender, EtwAnomaly^ e );
+
+void CollectAnomalyAlert(const AnomalyAlert & alert, void * context)
+{
+	((std::vector<AnomalyAlert> *)context)->push_back(alert);
+}
+
+//Online detection of traffic rate anomalies per process, remote subnet and remote port of the events passed by EtwSession
+public ref class EtwAnomalies
+{
+	static System::Object ^ sync = EtwStages::sync; //shared by the stages, see EtwStages
+	static AnomalyDetector * detector = NULL;
+	static std::vector<AnomalyAlert> * pending = NULL; //alerts are raised after the lock is released
+
+	static EtwAnomaly ^ FromAlert(const AnomalyAlert & alert)
+	{
+		EtwAnomaly ^ a = gcnew EtwAnomaly();
+		a->kind = (AnomalyKeyKinds)alert.kind;
+		a->metric = (AnomalyMetrics)alert.metric;
+		a->pid = (System::Int32)alert.pid;
+		a->port = alert.port;
+		if (alert.kind == AnomalyKeySubnet)
+		{
+			array<System::Byte> ^ bytes = gcnew array<System::Byte>(alert.ip6 ? 16 : 4);
+			for (int i = 0; i < bytes->Length; i++) bytes[i] = alert.subnet[i];
+			a->subnet = gcnew System::Net::IPAddress(bytes);
+		}
+		a->IntervalStart = System::DateTime::FromFileTime((System::Int64)alert.IntervalStart);
+		a->IntervalLength = System::TimeSpan((System::Int64)detector->interval);
+		a->value = alert.value;
+		a->mean = alert.mean;
+		a->deviation = alert.deviation;
+		a->score = alert.score;
+		return a;
+	}
+
+public:
+	//Raised on the ETW processing thread when a rate deviates from its baseline
+	static event AnomalyDelegate^ AnomalyDetected;
+
+	// Starts tracking up to MaxKeys processes, subnets and ports. Rates are measured over IntervalMilliseconds.
+	// An alert is raised when a rate exceeds its mean by more than Threshold standard deviations.
+	// With Seasonal, each hour of the day has its own baseline.
+
+	static void Enable(System::Int32 MaxKeys, System::Int32 IntervalMilliseconds, System::Double Threshold, System::Boolean Seasonal)
+	{
+		if (MaxKeys <= 0) throw gcnew System::ArgumentOutOfRangeException("MaxKeys");
+		if (IntervalMilliseconds <= 0) throw gcnew System::ArgumentOutOfRangeException("IntervalMilliseconds");
+		if (!(Threshold > 0)) throw gcnew System::ArgumentOutOfRangeException("Threshold"); //also rejects NaN
+
+		System::Threading::Monitor::Enter(sync);
+		try
+		{
+			delete detector;
+			detector = new AnomalyDetector((uint32_t)MaxKeys);
+			detector->interval = (uint64_t)IntervalMilliseconds * 10000;
+			detector->threshold = Threshold;
+			detector->seasonal = Seasonal;
+			detector->TimeZoneBias = (int32_t)System::TimeZoneInfo::Local->GetUtcOffset(System::DateTime::Now).TotalMinutes;
+			if (pending == NULL) pending = new std::vector<AnomalyAlert>();
+			detector->callback = CollectAnomalyAlert;
+			detector->context = pending;
+		}
+		finally
+		{
+			System::Threading::Monitor::Exit(sync);
+		}
+	}
+
+	static void Disable()
+	{
+		System::Threading::Monitor::Enter(sync);
+		try
+		{
+			delete detector;
+			detector = NULL;
+		}
+		finally
+		{
+			System::Threading::Monitor::Exit(sync);
+		}
+	}
+
+	static property System::Boolean Enabled { System::Boolean get(){ return detector != NULL; } }
+
+	//Number of processes, subnets and ports currently tracked
+	static property System::Int32 KeyCount
+	{
+		System::Int32 get(){
+			System::Threading::Monitor::Enter(sync);
+			try { return detector != NULL ? (System::Int32)detector->KeyCount() : 0; }
+			finally { System::Threading::Monitor::Exit(sync); }
+		}
+	}
+
+internal:
+
+	//Returns the alerts to Raise once the lock is released, or nullptr
+	static System::Collections::Generic::List<EtwAnomaly ^> ^ Process(const NetRecord & rec)
+	{
+		System::Collections::Generic::List<EtwAnomaly ^> ^ alerts = nullptr;
+
+		if (detector == NULL) return nullptr;
+
+		detector->Process(rec);
+		if (!pending->empty())
+		{
+			alerts = gcnew System::Collections::Generic::List<EtwAnomaly ^>((int)pending->size());
+			for (size_t i = 0; i < pending->size(); i++) alerts->Add(FromAlert((*pending)[i]));
+			pending->clear();
+		}
+		return alerts;
+	}
+
+	static void Raise(System::Collections::Generic::List<EtwAnomaly ^> ^ alerts)
+	{
+		for each (EtwAnomaly ^ a in alerts) AnomalyDetected(gcnew System::Object(), a);
+	}
+};
+/* ************ end EtwAnomalies ************ */
+
+
+/* ************ Shared memory publication ************ */
+
+//Sums the per-second aggregates of the last "seconds" seconds published (all of them if seconds <= 0). Returns the number of events
+uint64_t SumSharedAggregates(const SharedAggregates & a, int seconds, uint64_t & sent, uint64_t & recv)
+{
+	uint64_t newest = 0;
+	uint64_t events = 0;
+
+	if (seconds <= 0)
+	{
+		sent = a.SentBytes;
+		recv = a.RecvBytes;
+		return a.events;
+	}
+
+	sent = 0;
+	recv = 0;
+	for (int i = 0; i < SHARED_RING_SECONDS; i++)
+	{
+		if (a.seconds[i].second > newest) newest = a.seconds[i].second;
+	}
+	for (int i = 0; i < SHARED_RING_SECONDS; i++)
+	{
+		const SharedBucket & b = a.seconds[i];
+		if (b.events == 0 || b.second + (uint64_t)seconds <= newest) continue;
+		events += b.events;
+		sent += b.SentBytes;
+		recv += b.RecvBytes;
+	}
+	return events;
+}
+
+// Publishes TCP/IP events passed by EtwSession into a named shared-memory ring, together with rolling totals.
+// Any number of EtwSubscriber objects in other processes can read it, so that one capture serves them all.
+
+public ref class EtwPublisher
+{
+	static System::Object ^ sync = EtwStages::sync; //shared by the stages, see EtwStages
+	static SharedRingWriter * writer = NULL;
+
+public:
+
+	// Creates the ring "name" holding the last "capacity" events, rounded up to a power of 2. Use a "Global\\" name
+	// (e.g. "Global\\EtwNetwork") when subscribers run in other sessions, e.g. a desktop application reading from a
+	// service; "Local\\" names are only seen in the publisher's session. Any authenticated user can subscribe.
+	// Throws Win32Exception with ERROR_ALREADY_EXISTS if another live publisher uses the name.
+	static void Enable(System::String ^ name, System::Int32 capacity)
+	{
+		System::IntPtr p;
+
+		if (System::String::IsNullOrEmpty(name)) throw gcnew System::ArgumentNullException("name");
+		if (capacity <= 0) throw gcnew System::ArgumentOutOfRangeException("capacity");
+
+		System::Threading::Monitor::Enter(sync);
+		try
+		{
+			delete writer;
+			writer = NULL;
+
+			SharedRingWriter * w = new SharedRingWriter();
+			p = System::Runtime::InteropServices::Marshal::StringToHGlobalAnsi(name);
+			bool created = w->Create((const char *)p.ToPointer(), (uint32_t)capacity);
+			System::Runtime::InteropServices::Marshal::FreeHGlobal(p);
+
+			if (!created)
+			{
+				int error = w->Error();
+				delete w;
+				throw gcnew System::ComponentModel::Win32Exception(error);
+			}
+			writer = w;
+		}
+		finally
+		{
+			System::Threading::Monitor::Exit(sync);
+		}
+	}
+
+	//Marks the ring closed for subscribers and releases it
+	static void Disable()
+	{
+		System::Threading::Monitor::Enter(sync);
+		try
+		{
+			delete writer;
+			writer = NULL;
+		}
+		finally
+		{
+			System::Threading::Monitor::Exit(sync);
+		}
+	}
+
+	static property System::Boolean Enabled { System::Boolean get(){ return writer != NULL; } }
+
+	static property System::UInt64 Published
+	{
+		System::UInt64 get(){
+			System::Threading::Monitor::Enter(sync);
+			try { return writer != NULL ? writer->Published() : 0; }
+			finally { System::Threading::Monitor::Exit(sync); }
+		}
+	}
+
+internal:
+
+	static void Publish(const NetRecord & rec)
+	{
+		if (writer != NULL) writer->Publish(rec);
+	}
+};
+
+// Reads events published by EtwPublisher, possibly in another process. The ring is mapped read-only and
+// each subscriber has its own position in it; a subscriber that falls behind by more than the capacity
+// of the ring skips the overwritten events and counts them in Lost. Not thread-safe.
+
+public ref class EtwSubscriber
+{
+	SharedRingReader * reader;
+	NetRecord * buffer;
+	System::Int32 BufferSize;
+
+public:
+
+	//Attaches to the ring "name"; reading starts with events published after this point
+	EtwSubscriber(System::String ^ name)
+	{
+		System::IntPtr p;
+
+		if (System::String::IsNullOrEmpty(name)) throw gcnew System::ArgumentNullException("name");
+
+		reader = new SharedRingReader();
+		buffer = NULL;
+		BufferSize = 0;
+
+		p = System::Runtime::InteropServices::Marshal::StringToHGlobalAnsi(name);
+		bool opened = reader->Open((const char *)p.ToPointer());
+		System::Runtime::InteropServices::Marshal::FreeHGlobal(p);
+
+		if (!opened)
+		{
+			int error = reader->Error();
+			delete reader;
+			reader = NULL;
+			throw gcnew System::ComponentModel::Win32Exception(error);
+		}
+	}
+
+	~EtwSubscriber() { this->!EtwSubscriber(); }
+
+	!EtwSubscriber()
+	{
+		delete reader;
+		delete [] buffer;
+		reader = NULL;
+		buffer = NULL;
+	}
+
+	//Returns up to MaxEvents events published since the last call, oldest first; like EtwHistory events, without seqnum and connid
+	System::Collections::Generic::List<EtwEvent ^> ^ Read(System::Int32 MaxEvents)
+	{
+		System::Collections::Generic::List<EtwEvent ^> ^ res;
+		uint32_t n;
+
+		if (reader == NULL) throw gcnew System::ObjectDisposedException("EtwSubscriber");
+		if (MaxEvents <= 0) throw gcnew System::ArgumentOutOfRangeException("MaxEvents");
+
+		if (BufferSize < MaxEvents)
+		{
+			delete [] buffer;
+			buffer = new NetRecord[MaxEvents];
+			BufferSize = MaxEvents;
+		}
+
+		n = reader->Read(buffer, (uint32_t)MaxEvents);
+		res = gcnew System::Collections::Generic::List<EtwEvent ^>((int)n);
+		for (uint32_t i = 0; i < n; i++) res->Add(EventFromRecord(buffer[i], NULL));
+		return res;
+	}
+
+	//Sums weighted sent and received bytes over the last "seconds" seconds published (0 = since the publisher started). Returns the number of events
+	System::UInt64 GetTotals(System::Int32 seconds,
+		[System::Runtime::InteropServices::Out] System::Int64 % SentBytes,
+		[System::Runtime::InteropServices::Out] System::Int64 % RecvBytes)
+	{
+		SharedAggregates a;
+		uint64_t sent, recv, n;
+
+		if (reader == NULL) throw gcnew System::ObjectDisposedException("EtwSubscriber");
+		if (seconds > SHARED_RING_SECONDS) throw gcnew System::ArgumentOutOfRangeException("seconds");
+		if (!reader->ReadAggregates(&a)) throw gcnew System::TimeoutException("Publisher kept updating the totals");
+
+		n = SumSharedAggregates(a, seconds, sent, recv);
+		SentBytes = (System::Int64)sent;
+		RecvBytes = (System::Int64)recv;
+		return n;
+	}
+
+	//Events overwritten before this subscriber read them
+	property System::UInt64 Lost { System::UInt64 get(){ return reader != NULL ? reader->lost : 0; } }
+
+	//False once the publisher closed the ring or died; Read moves on by itself to the next publisher of the name
+	property System::Boolean PublisherActive { System::Boolean get(){ return reader != NULL && reader->WriterActive(); } }
+};
+/* ************ end Shared memory publication ************ */
+
+
+// Feeds the event to the enabled stages under their shared lock. Disabled stages cost a check each and
+// no lock at all; anomaly alerts are raised after the lock is released.
+
+void EtwStages::Process(const NetRecord & rec)
+{
+	System::Collections::Generic::List<EtwAnomaly ^> ^ alerts = nullptr;
+
+	if (!EtwHistory::Enabled && !EtwTraffic::Enabled && !EtwAnomalies::Enabled && !EtwPublisher::Enabled) return;
+
+	System::Threading::Monitor::Enter(sync);
+	try
+	{
+		EtwHistory::Append(rec);
+		EtwTraffic::Add(rec);
+		alerts = EtwAnomalies::Process(rec);
+		EtwPublisher::Publish(rec);
+	}
+	finally
+	{
+		System::Threading::Monitor::Exit(sync);
+	}
+
+	if (alerts != nullptr) EtwAnomalies::Raise(alerts);
+}
+
+
+// Decodes the part common to all TcpIp/UdpIp events directly from UserData, without TDH.
+// Returns FALSE for events of other providers or layouts.
+
+BOOL DecodeNetEvent(PEVENT_RECORD pEvent, NetRecord * rec)
+{
+	UCHAR proto = 0;
+
+	if (IsEqualGUID(pEvent->EventHeader.ProviderId, TcpIpEventGuid)) proto = NET_PROTO_TCP;
+	else if (IsEqualGUID(pEvent->EventHeader.ProviderId, UdpIpEventGuid)) proto = NET_PROTO_UDP;
+	else return FALSE;
+
+	if (!DecodeNetRecord(proto, pEvent->EventHeader.EventDescriptor.Opcode,
+		(const uint8_t *)pEvent->UserData, pEvent->UserDataLength, rec))
+	{
+		return FALSE;
+	}
+
+	rec->timestamp = pEvent->EventHeader.TimeStamp.QuadPart;
+	return TRUE;
+}
+
+// Passes the event through the adaptive sampler. Returns the weight of the event or 0 if it should be dropped.
+// Only send/receive events are sampled; connection state changes always pass with weight 1.
+// "rec" is NULL if the event could not be decoded by DecodeNetEvent.
+
+DWORD SampleNetEvent(PEVENT_RECORD pEvent, const NetRecord * rec)
+{
+	if (!IsEqualGUID(pEvent->EventHeader.ProviderId, TcpIpEventGuid) &&
+		!IsEqualGUID(pEvent->EventHeader.ProviderId, UdpIpEventGuid))
+	{
+		return 1;
+	}
+
+	if (!NetOpcodeIsData(pEvent->EventHeader.EventDescriptor.Opcode)) return 1;
+
+	if (SamplingPerFlow == Sampler.mode && rec != NULL)
+	{
+		return Sampler.SampleFlow(NetRecordFlowHash(rec));
+	}
+
+	return Sampler.SampleEvent();
+}
+
+// Returns the decoding plan for the schema of the event, compiling it from TRACE_EVENT_INFO when the schema
+// is seen for the first time. Returns NULL if the schema can't be decoded with a plan.
+
+DecodePlan * GetDecodePlan(PEVENT_RECORD pEvent, DWORD PointerSize)
+{
+	TDHSTATUS status = ERROR_SUCCESS;
+	DWORD BufferSize = 0;
+	PTRACE_EVENT_INFO pInfo = NULL;
+	DecodePlan * plan = NULL;
+	PlanKey key;
+	std::vector<PlanProperty> properties;
+	uint32_t TopLevelCount = 0;
+
+	ZeroMemory(&key, sizeof(key));
+	memcpy(key.provider, &pEvent->EventHeader.ProviderId, sizeof(key.provider));
+	key.id = pEvent->EventHeader.EventDescriptor.Id;
+	key.version = pEvent->EventHeader.EventDescriptor.Version;
+	key.opcode = pEvent->EventHeader.EventDescriptor.Opcode;
+	key.PointerSize = PointerSize;
+
+	if (DecodePlans.Find(key, &plan)) return plan;
+
+	// Errors are left to the TDH path, which reports them.
+
+	status = TdhGetEventInformation(pEvent, 0, NULL, NULL, &BufferSize);
+	if (ERROR_INSUFFICIENT_BUFFER != status) return NULL;
+
+	plan = new DecodePlan();
+	plan->schema.resize(BufferSize);
+	pInfo = (PTRACE_EVENT_INFO)&plan->schema[0];
+
+	status = TdhGetEventInformation(pEvent, 0, NULL, pInfo, &BufferSize);
+	if (ERROR_SUCCESS != status)
+	{
+		delete plan;
+		return NULL;
+	}
+
+	// WPP events are not handled by the callback at all
+
+	if ((DecodingSourceWbem != pInfo->DecodingSource && DecodingSourceXMLFile != pInfo->DecodingSource) ||
+		!ReadEventInfo(&plan->schema[0], BufferSize, properties, &TopLevelCount) ||
+		!plan->Compile(properties.empty() ? NULL : &properties[0], (uint32_t)properties.size(),
+			TopLevelCount, PointerSize))
+	{
+		delete plan;
+		plan = NULL;
+	}
+
+	DecodePlans.Add(key, plan);
+	return plan;
+}
+
+// Adds the property values decoded by a plan to the event.
+
+void AddPlanProperties(PEVENT_RECORD pEvent, PTRACE_EVENT_INFO pInfo, DWORD PointerSize, EtwEvent ^ ev)
+{
+	PBYTE pEndOfUserData = (PBYTE)pEvent->UserData + pEvent->UserDataLength;
+
+	for (size_t i = 0; i < PlanOutput.values.size(); i++)
+	{
+		const PlanValue & v = PlanOutput.values[i];
+		EtwEventProperty ^ prop = gcnew EtwEventProperty();
+
+		prop->name = gcnew System::String(
+			(PWCHAR)((PBYTE)(pInfo) + pInfo->EventPropertyInfoArray[v.property].NameOffset)
+			);
+
+		if (v.text == PLAN_NO_TEXT)
+		{
+			prop->value = FormatPropertyValue(pEvent, pInfo, PointerSize, v.property, v.length,
+				(PBYTE)v.data, pEndOfUserData);
+		}
+		else if (v.TextLength == 0) prop->value = System::String::Empty;
+		else prop->value = gcnew System::String((wchar_t *)&PlanOutput.text[v.text], 0, v.TextLength);
+
+		ev->properties->Add(prop);
+	}
+}
+
+// Formats a single value with TDH, for the values a decoding plan doesn't format itself.
+
+System::String ^ FormatPropertyValue(PEVENT_RECORD pEvent, PTRACE_EVENT_INFO pInfo, DWORD PointerSize, USHORT i,
+	USHORT PropertyLength, PBYTE pUserData, PBYTE pEndOfUserData)
+{
+	TDHSTATUS status = ERROR_SUCCESS;
+	DWORD FormattedDataSize = 0;
+	USHORT UserDataConsumed = 0;
+	LPWSTR pFormattedData = NULL;
+	PEVENT_MAP_INFO pMapInfo = NULL;
+	System::String ^ value = nullptr;
+
+	if (pInfo->EventPropertyInfoArray[i].nonStructType.MapNameOffset != 0)
+	{
+		status = GetMapInfo(pEvent, 
+			(PWCHAR)((PBYTE)(pInfo) + pInfo->EventPropertyInfoArray[i].nonStructType.MapNameOffset),
+			pInfo->DecodingSource,
+			pMapInfo);
+	}
+
+	status = TdhFormatProperty(pInfo, pMapInfo, PointerSize, 
+		pInfo->EventPropertyInfoArray[i].nonStructType.InType,
+		pInfo->EventPropertyInfoArray[i].nonStructType.OutType,
+		PropertyLength, (USHORT)(pEndOfUserData - pUserData), pUserData,
+		&FormattedDataSize, pFormattedData, &UserDataConsumed);
+
+	if (ERROR_INSUFFICIENT_BUFFER == status)
+	{
+		pFormattedData = (LPWSTR) malloc(FormattedDataSize);
+		if (pFormattedData == NULL)
+		{
+			status = ERROR_OUTOFMEMORY;
+			goto cleanup;
+		}
+
+		status = TdhFormatProperty(pInfo, pMapInfo, PointerSize, 
+			pInfo->EventPropertyInfoArray[i].nonStructType.InType,
+			pInfo->EventPropertyInfoArray[i].nonStructType.OutType,
+			PropertyLength, (USHORT)(pEndOfUserData - pUserData), pUserData,
+			&FormattedDataSize, pFormattedData, &UserDataConsumed);
+	}
+
+	if (ERROR_SUCCESS == status) value = gcnew System::String(pFormattedData);
+
+cleanup:
+
+	if (pFormattedData) free(pFormattedData);
+	if (pMapInfo) free(pMapInfo);
+
+	if(status != ERROR_SUCCESS){
+		throw gcnew System::ComponentModel::Win32Exception(status);
+	}
+
+	return value;
+}
+
 //Called on new ETW Event
 VOID WINAPI EventCallback(PEVENT_RECORD pEvent)
 {    
@@ -628,7 +1767,19 @@ VOID WINAPI EventCallback(PEVENT_RECORD pEvent)
     SYSTEMTIME st;
     SYSTEMTIME stLocal;
     FILETIME ft;
-	EtwEvent ^ ev = gcnew EtwEvent();
+	FILETIME ftNow;
+	LARGE_INTEGER qpcStart;
+	LARGE_INTEGER qpcEnd;
+	ULONGLONG now = 0;
+	ULONGLONG lag = 0;
+	DWORD weight = 1;
+	NetRecord rec;
+	BOOL decoded = FALSE;
+	DecodePlan * plan = NULL;
+	EtwEvent ^ ev = nullptr; //allocated only for events that are raised
+
+	QueryPerformanceCounter(&qpcStart);
+	decoded = DecodeNetEvent(pEvent, &rec);
 
     // Skips the event if it is the event trace header.
 
@@ -637,12 +1788,53 @@ VOID WINAPI EventCallback(PEVENT_RECORD pEvent)
     {
         ; // Skip this event.
     }
+	else if (0 == (weight = SampleNetEvent(pEvent, decoded ? &rec : NULL)))
+	{
+		; // Dropped by the sampler
+	}
     else
     {
+		if (decoded)
+		{
+			rec.weight = weight;
+			EtwStages::Process(rec);
+		}
+
+		// Send/receive events are taken by the coalescing stage and raised as merged events later.
+		// Other events of a connection first flush the merged event preceding them.
+
+		if (decoded && fCoalesce)
+		{
+			NetConnection conn;
+			BOOL HasConnection = DecodeNetConnection(rec.proto, rec.opcode, (const uint8_t *)pEvent->UserData,
+				pEvent->UserDataLength, (pEvent->EventHeader.Flags & EVENT_HEADER_FLAG_32_BIT_HEADER) ? 4 : 8, &conn);
+			BOOL taken = Coalescer.Process(rec, pEvent->EventHeader.EventDescriptor.Version, HasConnection ? &conn : NULL);
+			RaiseCoalesced();
+			if (taken) goto cleanup;
+		}
+		else if (!fCoalesce && Coalescer.Pending() > 0)
+		{
+			Coalescer.Flush(); //coalescing was turned off
+			RaiseCoalesced();
+		}
+
+        if (EVENT_HEADER_FLAG_32_BIT_HEADER == (pEvent->EventHeader.Flags & EVENT_HEADER_FLAG_32_BIT_HEADER))
+        {
+            PointerSize = 4;
+        }
+        else
+        {
+            PointerSize = 8;
+        }
+
         // Process the event. The pEvent->UserData member is a pointer to 
         // the event specific data, if it exists.
+        // The metadata of schemas with a decoding plan is kept with the plan.
 
-        status = GetEventInformation(pEvent, pInfo);
+        if (fDecodePlans) plan = GetDecodePlan(pEvent, PointerSize);
+
+        if (plan != NULL) pInfo = (PTRACE_EVENT_INFO)&plan->schema[0];
+        else status = GetEventInformation(pEvent, pInfo);
 
         if (ERROR_SUCCESS != status)
         {
@@ -650,6 +1842,8 @@ VOID WINAPI EventCallback(PEVENT_RECORD pEvent)
             goto cleanup;
         }
 
+        ev = gcnew EtwEvent();
+
         // Determine whether the event is defined by a MOF class, in an
         // instrumentation manifest, or a WPP template.
 
@@ -698,47 +1892,59 @@ VOID WINAPI EventCallback(PEVENT_RECORD pEvent)
             stLocal.wMonth, stLocal.wDay, stLocal.wYear, stLocal.wHour, stLocal.wMinute, stLocal.wSecond, Nanoseconds);*/
 		ev->timestamp = System::DateTime(stLocal.wYear, stLocal.wMonth, stLocal.wDay,
 			stLocal.wHour, stLocal.wMinute, stLocal.wSecond, Nanoseconds / 1000000);
+		ev->LastTimestamp = ev->timestamp;
 
         // If the event contains event-specific data use TDH to extract
         // the event data. 		       
 
-        if (EVENT_HEADER_FLAG_32_BIT_HEADER == (pEvent->EventHeader.Flags & EVENT_HEADER_FLAG_32_BIT_HEADER))
-        {
-            PointerSize = 4;
-        }
-        else
-        {
-            PointerSize = 8;
-        }
-
-
         pUserData = (PBYTE)pEvent->UserData;
         pEndOfUserData = (PBYTE)pEvent->UserData + pEvent->UserDataLength;
 
-        // Print the event data for all the top-level properties. 				
+        // Events of schemas with a plan are decoded from UserData directly; the plan
+        // rejects events not matching the schema, and those go through TDH.
 
-        for (USHORT i = 0; i < pInfo->TopLevelPropertyCount; i++)
+        PlanOutput.Clear();
+        if (plan != NULL && plan->Execute(pUserData, pEvent->UserDataLength, PlanOutput))
+        {
+            AddPlanProperties(pEvent, pInfo, PointerSize, ev);
+        }
+        else
         {
-            pUserData = PrintProperties(pEvent, pInfo, PointerSize, i, pUserData, pEndOfUserData,ev);
-            if (NULL == pUserData)
+            // Print the event data for all the top-level properties. 				
+
+            for (USHORT i = 0; i < pInfo->TopLevelPropertyCount; i++)
             {
-                //wprintf(L"Printing top level properties failed.\n");
-                goto cleanup;
+                pUserData = PrintProperties(pEvent, pInfo, PointerSize, i, pUserData, pEndOfUserData,ev);
+                if (NULL == pUserData)
+                {
+                    //wprintf(L"Printing top level properties failed.\n");
+                    goto cleanup;
+                }
             }
         }
 
-		System::String ^ str = ev->ToString();
-		
+		ev->weight = weight;
 		EtwSession::OnNewEvent(ev);
     }
 
 cleanup:
 
-    if (pInfo)
+    if (pInfo && plan == NULL)
     {
         free(pInfo);
     }    
 
+	// Feed the sampler with how late the event was delivered and how long it took to process.
+
+	QueryPerformanceCounter(&qpcEnd);
+	GetSystemTimeAsFileTime(&ftNow);
+	now = ((ULONGLONG)ftNow.dwHighDateTime << 32) | ftNow.dwLowDateTime;
+	if (now > (ULONGLONG)pEvent->EventHeader.TimeStamp.QuadPart) lag = now - pEvent->EventHeader.TimeStamp.QuadPart;
+	if (QpcFrequency.QuadPart > 0)
+	{
+		Sampler.Observe(now, lag, (ULONGLONG)(qpcEnd.QuadPart - qpcStart.QuadPart) * 10000000 / QpcFrequency.QuadPart);
+	}
+
 	if(status != ERROR_SUCCESS ){
 		throw gcnew System::ComponentModel::Win32Exception(status);
 	}
@@ -747,6 +1953,37 @@ cleanup:
 //return FALSE to end ETW Session
 BOOL WINAPI BufferEventCallback(PEVENT_TRACE_LOGFILE buf)
 {
+		// Query how many session buffers are still waiting for delivery and how many were lost.
+
+		if (pQueryProperties != NULL)
+		{
+			ZeroMemory(pQueryProperties, sizeof(EVENT_TRACE_PROPERTIES) + sizeof(KERNEL_LOGGER_NAME));
+			pQueryProperties->Wnode.BufferSize = sizeof(EVENT_TRACE_PROPERTIES) + sizeof(KERNEL_LOGGER_NAME);
+			pQueryProperties->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
+
+			if (ERROR_SUCCESS == ControlTrace(0, KERNEL_LOGGER_NAME, pQueryProperties, EVENT_TRACE_CONTROL_QUERY))
+			{
+				Sampler.ObserveQueue(
+					pQueryProperties->NumberOfBuffers - pQueryProperties->FreeBuffers,
+					pQueryProperties->NumberOfBuffers,
+					ProcessorCount,
+					(uint64_t)pQueryProperties->EventsLost + pQueryProperties->RealTimeBuffersLost);
+			}
+		}
+        
+		// Pass on merged events whose window ended while no further events came. Events reach us up to the
+		// flush delay after they are logged, so the clock is set back by that much: a later buffer may still
+		// hold events of a window that ended less than that ago.
+
+		if (Coalescer.Pending() > 0)
+		{
+			FILETIME ftNow;
+			uint64_t now;
+			GetSystemTimeAsFileTime(&ftNow);
+			now = ((uint64_t)ftNow.dwHighDateTime << 32) | ftNow.dwLowDateTime;
+			Coalescer.Expire(now - Sampler.FlushDelay);
+			RaiseCoalesced();
+		}
         
 		if(fStop != FALSE){
 			fStop = FALSE;
@@ -0,0 +1,367 @@
+//Compressed in-memory history of network events
+
+#include <string.h>
+
+#include "HistoryStore.h"
+
+namespace EtwNetwork
+{
+
+HistoryFilter::HistoryFilter()
+{
+	from = 0;
+	to = 0xFFFFFFFFFFFFFFFFULL;
+	pid = 0;
+	AnyPid = true;
+	port = 0;
+	memset(addr, 0, sizeof(addr));
+	AddrLength = 0;
+	opcode = 0;
+}
+
+void FlowFromRecord(const NetRecord & rec, HistoryFlow * flow)
+{
+	memset(flow, 0, sizeof(HistoryFlow)); //padding takes part in comparisons
+	flow->pid = rec.pid;
+	memcpy(flow->daddr, rec.daddr, 16);
+	memcpy(flow->saddr, rec.saddr, 16);
+	flow->dport = rec.dport;
+	flow->sport = rec.sport;
+	flow->proto = rec.proto;
+	flow->ip6 = rec.ip6;
+}
+
+void RecordFromFlow(const HistoryFlow & flow, NetRecord * rec)
+{
+	rec->pid = flow.pid;
+	memcpy(rec->daddr, flow.daddr, 16);
+	memcpy(rec->saddr, flow.saddr, 16);
+	rec->dport = flow.dport;
+	rec->sport = flow.sport;
+	rec->proto = flow.proto;
+	rec->ip6 = flow.ip6;
+	rec->reserved = 0;
+}
+
+//Hash of the flow with direction, unlike NetRecordFlowHash
+static uint32_t FlowKeyHash(const HistoryFlow & flow)
+{
+	const uint8_t * p = (const uint8_t *)&flow;
+	uint32_t h = 2166136261U; //FNV-1a
+
+	for (size_t i = 0; i < sizeof(HistoryFlow); i++) { h ^= p[i]; h *= 16777619U; }
+	return h;
+}
+
+static uint8_t BitsFor(uint32_t MaxValue)
+{
+	uint8_t bits = 0;
+	while (bits < 32 && (MaxValue >> bits) != 0) bits++;
+	return bits;
+}
+
+/* BitColumn */
+
+void BitColumn::Pack(const std::vector<uint32_t> & values)
+{
+	uint64_t pos = 0;
+
+	words.clear();
+	if (bits == 0) return;
+	words.resize((size_t)(((uint64_t)values.size() * bits + 63) / 64) + 1, 0);
+
+	for (size_t i = 0; i < values.size(); i++, pos += bits)
+	{
+		uint32_t w = (uint32_t)(pos >> 6);
+		uint32_t shift = (uint32_t)(pos & 63);
+		words[w] |= (uint64_t)values[i] << shift;
+		if (shift + bits > 64) words[w + 1] |= (uint64_t)values[i] >> (64 - shift);
+	}
+}
+
+/* HistorySegment */
+
+size_t HistorySegment::MemoryUsage() const
+{
+	return sizeof(HistorySegment) + timestamps.capacity() + flows.capacity() * sizeof(uint32_t) +
+		opcodes.capacity() + weights.capacity() * sizeof(uint32_t) +
+		(FlowCodes.words.capacity() + OpcodeCodes.words.capacity() +
+		WeightCodes.words.capacity() + sizes.words.capacity()) * sizeof(uint64_t);
+}
+
+/* HistoryStore */
+
+HistoryStore::HistoryStore(size_t MaxBytes)
+{
+	this->MaxBytes = MaxBytes;
+	OpenLimit = 0;
+	SealedEvents = 0;
+	SealedBytes = 0;
+}
+
+void HistoryStore::Append(const NetRecord & rec)
+{
+	if (open.empty())
+	{
+		//a small budget gets smaller segments rather than being taken up by the open one
+		OpenLimit = MaxBytes / HISTORY_OPEN_SHARE / sizeof(NetRecord);
+		if (OpenLimit > HISTORY_SEGMENT_EVENTS) OpenLimit = HISTORY_SEGMENT_EVENTS;
+		if (OpenLimit < HISTORY_MIN_SEGMENT_EVENTS) OpenLimit = HISTORY_MIN_SEGMENT_EVENTS;
+		open.reserve(OpenLimit);
+	}
+	open.push_back(rec);
+	if (open.size() >= OpenLimit) Seal();
+}
+
+uint32_t HistoryStore::InternFlow(const NetRecord & rec, uint32_t * hash)
+{
+	HistoryFlow flow;
+	uint32_t id;
+
+	FlowFromRecord(rec, &flow);
+	*hash = FlowKeyHash(flow);
+
+	std::pair<std::unordered_multimap<uint32_t, uint32_t>::const_iterator,
+		std::unordered_multimap<uint32_t, uint32_t>::const_iterator> range = FlowIndex.equal_range(*hash);
+	for (std::unordered_multimap<uint32_t, uint32_t>::const_iterator it = range.first; it != range.second; ++it)
+	{
+		if (memcmp(&flows[it->second], &flow, sizeof(HistoryFlow)) == 0) return it->second;
+	}
+
+	if (!FreeFlows.empty())
+	{
+		id = FreeFlows.back();
+		FreeFlows.pop_back();
+		flows[id] = flow;
+	}
+	else
+	{
+		id = (uint32_t)flows.size();
+		flows.push_back(flow);
+		FlowRefs.push_back(0);
+	}
+
+	FlowIndex.insert(std::make_pair(*hash, id));
+	return id;
+}
+
+void HistoryStore::Seal()
+{
+	HistorySegment * seg;
+	std::unordered_map<uint32_t, uint32_t> LocalFlows; //flow id -> segment code
+	std::vector<uint32_t> FlowCodes, OpcodeCodes, WeightCodes, sizes;
+	uint64_t prev;
+	uint32_t MaxSize = 0;
+	uint32_t hash;
+
+	if (open.empty()) return;
+
+	seg = new HistorySegment();
+	seg->count = (uint32_t)open.size();
+	seg->FirstTimestamp = open[0].timestamp;
+	seg->MinTimestamp = open[0].timestamp;
+	seg->MaxTimestamp = open[0].timestamp;
+	seg->timestamps.reserve(open.size() * 2);
+	FlowCodes.resize(open.size());
+	OpcodeCodes.resize(open.size());
+	WeightCodes.resize(open.size());
+	sizes.resize(open.size());
+	prev = seg->FirstTimestamp;
+
+	for (size_t i = 0; i < open.size(); i++)
+	{
+		const NetRecord & rec = open[i];
+		int64_t delta = (int64_t)(rec.timestamp - prev);
+		uint64_t zz = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63); //zigzag: ETW may deliver slightly out of order
+		size_t code;
+
+		prev = rec.timestamp;
+		if (rec.timestamp < seg->MinTimestamp) seg->MinTimestamp = rec.timestamp;
+		if (rec.timestamp > seg->MaxTimestamp) seg->MaxTimestamp = rec.timestamp;
+		while (zz >= 0x80) { seg->timestamps.push_back((uint8_t)(zz | 0x80)); zz >>= 7; }
+		seg->timestamps.push_back((uint8_t)zz);
+
+		uint32_t id = InternFlow(rec, &hash);
+		std::unordered_map<uint32_t, uint32_t>::const_iterator it = LocalFlows.find(id);
+		if (it == LocalFlows.end())
+		{
+			FlowCodes[i] = (uint32_t)seg->flows.size();
+			LocalFlows.insert(std::make_pair(id, FlowCodes[i]));
+			seg->flows.push_back(id);
+			FlowRefs[id]++;
+		}
+		else FlowCodes[i] = it->second;
+
+		for (code = 0; code < seg->opcodes.size() && seg->opcodes[code] != rec.opcode; code++) {}
+		if (code == seg->opcodes.size()) seg->opcodes.push_back(rec.opcode);
+		OpcodeCodes[i] = (uint32_t)code;
+
+		for (code = 0; code < seg->weights.size() && seg->weights[code] != rec.weight; code++) {}
+		if (code == seg->weights.size()) seg->weights.push_back(rec.weight);
+		WeightCodes[i] = (uint32_t)code;
+
+		sizes[i] = rec.size;
+		if (rec.size > MaxSize) MaxSize = rec.size;
+	}
+
+	seg->FlowCodes.bits = BitsFor((uint32_t)seg->flows.size() - 1);
+	seg->FlowCodes.Pack(FlowCodes);
+	seg->OpcodeCodes.bits = BitsFor((uint32_t)seg->opcodes.size() - 1);
+	seg->OpcodeCodes.Pack(OpcodeCodes);
+	seg->WeightCodes.bits = BitsFor((uint32_t)seg->weights.size() - 1);
+	seg->WeightCodes.Pack(WeightCodes);
+	seg->sizes.bits = BitsFor(MaxSize);
+	seg->sizes.Pack(sizes);
+	seg->timestamps.shrink_to_fit();
+	seg->flows.shrink_to_fit();
+
+	segments.push_back(seg);
+	SealedEvents += seg->count;
+	SealedBytes += seg->MemoryUsage();
+	std::vector<NetRecord>().swap(open); //an idle history holds only compressed segments
+
+
+	Evict();
+}
+
+void HistoryStore::ReleaseSegment(HistorySegment * seg)
+{
+	for (size_t i = 0; i < seg->flows.size(); i++)
+	{
+		uint32_t id = seg->flows[i];
+		if (--FlowRefs[id] != 0) continue;
+
+		//no segment uses the flow anymore, free its slot
+		std::pair<std::unordered_multimap<uint32_t, uint32_t>::iterator,
+			std::unordered_multimap<uint32_t, uint32_t>::iterator> range = FlowIndex.equal_range(FlowKeyHash(flows[id]));
+		for (std::unordered_multimap<uint32_t, uint32_t>::iterator it = range.first; it != range.second; ++it)
+		{
+			if (it->second == id) { FlowIndex.erase(it); break; }
+		}
+		FreeFlows.push_back(id);
+	}
+
+	SealedEvents -= seg->count;
+	SealedBytes -= seg->MemoryUsage();
+	delete seg;
+}
+
+void HistoryStore::Evict()
+{
+	while (segments.size() > 1 && MemoryUsage() > MaxBytes)
+	{
+		ReleaseSegment(segments.front());
+		segments.pop_front();
+	}
+}
+
+void HistoryStore::Clear()
+{
+	while (!segments.empty())
+	{
+		ReleaseSegment(segments.front());
+		segments.pop_front();
+	}
+	std::vector<NetRecord>().swap(open);
+}
+
+bool HistoryStore::MatchFlow(const HistoryFilter & filter, const HistoryFlow & flow) const
+{
+	if (!filter.AnyPid && flow.pid != filter.pid) return false;
+	if (filter.port != 0 && flow.sport != filter.port && flow.dport != filter.port) return false;
+
+	if (filter.AddrLength != 0)
+	{
+		if ((filter.AddrLength == 16) != (flow.ip6 != 0)) return false;
+		if (memcmp(flow.saddr, filter.addr, filter.AddrLength) != 0 &&
+			memcmp(flow.daddr, filter.addr, filter.AddrLength) != 0) return false;
+	}
+	return true;
+}
+
+// Only the flow codes and timestamps are read for every event. The flow dictionary is matched once
+// per segment, and the other columns are read at fixed bit offsets for matching events only.
+
+uint64_t HistoryStore::Scan(const HistoryFilter & filter, HistoryCallback callback, void * context) const
+{
+	uint64_t matched = 0;
+	std::vector<uint8_t> FlowMatch;
+	NetRecord rec;
+	HistoryFlow flow;
+
+	for (size_t s = 0; s < segments.size(); s++)
+	{
+		const HistorySegment * seg = segments[s];
+		bool any = false;
+		uint32_t OpcodeCode = 0;
+		uint64_t ts = seg->FirstTimestamp;
+		size_t pos = 0;
+
+		if (seg->MaxTimestamp < filter.from || seg->MinTimestamp >= filter.to) continue;
+
+		if (filter.opcode != 0)
+		{
+			for (OpcodeCode = 0; OpcodeCode < seg->opcodes.size() && seg->opcodes[OpcodeCode] != filter.opcode; OpcodeCode++) {}
+			if (OpcodeCode == seg->opcodes.size()) continue;
+		}
+
+		FlowMatch.assign(seg->flows.size(), 0);
+		for (size_t c = 0; c < seg->flows.size(); c++)
+		{
+			FlowMatch[c] = MatchFlow(filter, flows[seg->flows[c]]);
+			any = any || FlowMatch[c];
+		}
+		if (!any) continue;
+
+		for (uint32_t i = 0; i < seg->count; i++)
+		{
+			uint64_t zz = 0;
+			uint32_t shift = 0;
+			uint32_t code;
+
+			do { zz |= (uint64_t)(seg->timestamps[pos] & 0x7F) << shift; shift += 7; } while (seg->timestamps[pos++] & 0x80);
+			ts += (uint64_t)((int64_t)(zz >> 1) ^ -(int64_t)(zz & 1));
+
+			code = seg->FlowCodes.Get(i);
+			if (!FlowMatch[code] || ts < filter.from || ts >= filter.to) continue;
+			if (filter.opcode != 0 && seg->OpcodeCodes.Get(i) != OpcodeCode) continue;
+
+			RecordFromFlow(flows[seg->flows[code]], &rec);
+			rec.timestamp = ts;
+			rec.size = seg->sizes.Get(i);
+			rec.opcode = seg->opcodes[seg->OpcodeCodes.Get(i)];
+			rec.weight = seg->weights[seg->WeightCodes.Get(i)];
+			matched++;
+			if (callback != NULL && !callback(rec, context)) return matched;
+		}
+	}
+
+	for (size_t i = 0; i < open.size(); i++)
+	{
+		const NetRecord & r = open[i];
+
+		if (r.timestamp < filter.from || r.timestamp >= filter.to) continue;
+		if (filter.opcode != 0 && r.opcode != filter.opcode) continue;
+		FlowFromRecord(r, &flow);
+		if (!MatchFlow(filter, flow)) continue;
+
+		matched++;
+		if (callback != NULL && !callback(r, context)) return matched;
+	}
+
+	return matched;
+}
+
+uint64_t HistoryStore::EventCount() const
+{
+	return SealedEvents + open.size();
+}
+
+size_t HistoryStore::MemoryUsage() const
+{
+	return SealedBytes + open.capacity() * sizeof(NetRecord) +
+		flows.capacity() * sizeof(HistoryFlow) + FlowRefs.capacity() * sizeof(uint32_t) +
+		FreeFlows.capacity() * sizeof(uint32_t) + FlowIndex.size() * 3 * sizeof(void *);
+}
+
+} // END NAMESPACE
@@ -0,0 +1,143 @@
+//Compressed in-memory history of network events
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+#include "NetRecord.h"
+
+namespace EtwNetwork
+{
+
+#define HISTORY_SEGMENT_EVENTS 65536 //events per segment, at most
+#define HISTORY_MIN_SEGMENT_EVENTS 1024
+#define HISTORY_OPEN_SHARE 8 //the open segment takes at most 1/8 of the memory budget
+
+//Selects events when scanning history. Default-constructed filter matches everything
+struct HistoryFilter
+{
+	uint64_t from; //FILETIME range [from, to)
+	uint64_t to;
+	uint32_t pid;
+	bool AnyPid;
+	uint16_t port; //matches either source or destination port, 0 = any
+	uint8_t addr[16]; //matches either source or destination address
+	uint8_t AddrLength; //4 for IPv4, 16 for IPv6, 0 = any
+	uint8_t opcode; //0 = any
+
+	HistoryFilter();
+};
+
+//Called for each event matching the filter, return false to stop the scan
+typedef bool (*HistoryCallback)(const NetRecord & rec, void * context);
+
+//Connection attributes shared by many events; stored once per store and referenced by segments
+struct HistoryFlow
+{
+	uint32_t pid;
+	uint8_t daddr[16];
+	uint8_t saddr[16];
+	uint16_t dport;
+	uint16_t sport;
+	uint8_t proto;
+	uint8_t ip6;
+};
+
+//Fixed-width bit-packed integers
+class BitColumn
+{
+public:
+	std::vector<uint64_t> words;
+	uint8_t bits;
+
+	void Pack(const std::vector<uint32_t> & values);
+
+	inline uint32_t Get(uint32_t i) const
+	{
+		uint64_t pos;
+		uint32_t w, shift;
+		uint64_t v;
+
+		if (bits == 0) return 0;
+		pos = (uint64_t)i * bits;
+		w = (uint32_t)(pos >> 6);
+		shift = (uint32_t)(pos & 63);
+		v = words[w] >> shift;
+		if (shift + bits > 64) v |= words[w + 1] << (64 - shift);
+		return (uint32_t)(v & ((1ULL << bits) - 1));
+	}
+};
+
+// Immutable block of events stored as columns:
+// timestamps as zigzag varint deltas, flows, opcodes and weights as bit-packed dictionary codes,
+// sizes bit-packed with the width of the largest size in the segment
+
+struct HistorySegment
+{
+	uint32_t count;
+	uint64_t MinTimestamp;
+	uint64_t MaxTimestamp;
+	uint64_t FirstTimestamp;
+
+	std::vector<uint8_t> timestamps;
+	std::vector<uint32_t> flows; //segment code -> HistoryStore flow id
+	std::vector<uint8_t> opcodes; //segment code -> opcode
+	std::vector<uint32_t> weights; //segment code -> weight
+	BitColumn FlowCodes;
+	BitColumn OpcodeCodes;
+	BitColumn WeightCodes;
+	BitColumn sizes;
+
+	size_t MemoryUsage() const;
+};
+
+// Event history which holds many more events in the same memory than decoded event objects.
+// Events are appended into an open (uncompressed) segment, which is sealed into a compressed
+// HistorySegment when full. When the memory budget is exceeded, the oldest segments are dropped.
+// The open segment is sized from the budget and its memory is released when it is sealed.
+// Not thread-safe: the caller must serialize Append with Scan.
+
+class HistoryStore
+{
+public:
+	HistoryStore(size_t MaxBytes);
+
+	size_t MaxBytes; //memory budget; the open segment, the newest sealed one and their flows are kept even above it
+
+	void Append(const NetRecord & rec);
+	void Seal(); //compresses the open segment, even if it is not full
+	void Clear();
+
+	//Calls "callback" for every stored event matching the filter, oldest first. Returns the number of matched events
+	uint64_t Scan(const HistoryFilter & filter, HistoryCallback callback, void * context) const;
+
+	uint64_t EventCount() const;
+	size_t MemoryUsage() const;
+
+private:
+	std::deque<HistorySegment *> segments;
+	std::vector<NetRecord> open;
+	size_t OpenLimit; //events the open segment takes before it is sealed
+	uint64_t SealedEvents;
+	size_t SealedBytes;
+
+	//flow dictionary
+	std::vector<HistoryFlow> flows;
+	std::vector<uint32_t> FlowRefs; //number of segments referencing the flow, 0 = free slot
+	std::vector<uint32_t> FreeFlows;
+	std::unordered_multimap<uint32_t, uint32_t> FlowIndex; //hash -> flow id
+
+	uint32_t InternFlow(const NetRecord & rec, uint32_t * hash);
+	void ReleaseSegment(HistorySegment * seg);
+	void Evict();
+	bool MatchFlow(const HistoryFilter & filter, const HistoryFlow & flow) const;
+};
+
+//Decodes HistoryFlow fields into NetRecord and back
+void FlowFromRecord(const NetRecord & rec, HistoryFlow * flow);
+void RecordFromFlow(const HistoryFlow & flow, NetRecord * rec);
+
+} // END NAMESPACE
@@ -0,0 +1,508 @@
+//Batch classification of network records: port byte order, direction, local/loopback/multicast addresses, byte totals
+
+#include <string.h>
+
+#include "NetBatch.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define NET_BATCH_X86
+#endif
+
+#ifdef NET_BATCH_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#endif
+
+// MSVC accepts any intrinsic in any function; GCC and Clang need the instruction set enabled per function,
+// so that the rest of the file still runs on CPUs without it.
+#if defined(_MSC_VER)
+#define NET_TARGET(isa)
+#else
+#define NET_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace EtwNetwork
+{
+
+// IPv4 addresses are compared as 32-bit words loaded from memory. On little-endian CPUs (everything
+// Windows runs on) the first byte of the address is the low byte of the word.
+#define NET_V4_FIRST_BYTE 0x000000FF
+#define NET_V4_LOOPBACK 0x0000007F //127.x.x.x
+#define NET_V4_MULTICAST_MASK 0x000000F0
+#define NET_V4_MULTICAST 0x000000E0 //224.0.0.0/4
+
+static int SelectedIsa = -1;
+
+/* ****** Local addresses ****** */
+
+void NetLocalAddressesClear(NetLocalAddresses * local)
+{
+	local->count4 = 0;
+	local->count6 = 0;
+}
+
+bool NetLocalAddressesAdd(NetLocalAddresses * local, const uint8_t * addr, bool ip6)
+{
+	if (ip6)
+	{
+		if (local->count6 >= NET_LOCAL_MAX6) return false;
+		memcpy(local->v6[local->count6++], addr, 16);
+	}
+	else
+	{
+		if (local->count4 >= NET_LOCAL_MAX4) return false;
+		memcpy(&local->v4[local->count4++], addr, 4);
+	}
+	return true;
+}
+
+/* ****** Filling blocks ****** */
+
+bool NetBatchAppendEvent(NetBatch * b, uint8_t opcode, const uint8_t * pUserData, uint32_t UserDataLength, uint32_t weight)
+{
+	uint32_t AddrLength;
+	uint32_t i = b->count;
+
+	if (i >= NET_BATCH_SIZE) return false;
+	if (opcode < NET_OPCODE_SEND || opcode == NET_OPCODE_FAIL || opcode > NET_OPCODE_TCPCOPY_IP6) return false;
+	if (opcode > NET_OPCODE_TCPCOPY && opcode < NET_OPCODE_SEND_IP6) return false;
+
+	AddrLength = NetOpcodeIsIp6(opcode) ? 16 : 4;
+	if (UserDataLength < 12 + 2 * AddrLength) return false;
+
+	memcpy(&b->size[i], pUserData + 4, 4);
+	memcpy(&b->daddr4[i], pUserData + 8, 4);
+	memcpy(&b->saddr4[i], pUserData + 8 + AddrLength, 4);
+	if (AddrLength == 16)
+	{
+		memcpy(b->daddr6[i], pUserData + 8, 16);
+		memcpy(b->saddr6[i], pUserData + 24, 16);
+	}
+	memcpy(&b->dport[i], pUserData + 8 + 2 * AddrLength, 2);
+	memcpy(&b->sport[i], pUserData + 10 + 2 * AddrLength, 2);
+	b->weight[i] = weight;
+	b->opcode[i] = opcode;
+	b->ip6[i] = (AddrLength == 16);
+	b->count++;
+	return true;
+}
+
+bool NetBatchAppendRecord(NetBatch * b, const NetRecord & rec)
+{
+	uint32_t i = b->count;
+
+	if (i >= NET_BATCH_SIZE) return false;
+
+	b->size[i] = rec.size;
+	b->weight[i] = rec.weight;
+	memcpy(&b->saddr4[i], rec.saddr, 4);
+	memcpy(&b->daddr4[i], rec.daddr, 4);
+	if (rec.ip6)
+	{
+		memcpy(b->saddr6[i], rec.saddr, 16);
+		memcpy(b->daddr6[i], rec.daddr, 16);
+	}
+	b->sport[i] = (uint16_t)((rec.sport >> 8) | (rec.sport << 8)); //back to the order the block keeps until processed
+	b->dport[i] = (uint16_t)((rec.dport >> 8) | (rec.dport << 8));
+	b->opcode[i] = rec.opcode;
+	b->ip6[i] = rec.ip6 != 0;
+	b->count++;
+	return true;
+}
+
+/* ****** Scalar kernels ****** */
+
+static inline uint8_t RowDirection(uint8_t opcode, uint8_t flags)
+{
+	if (NetOpcodeIsSend(opcode)) return NET_DIRECTION_SEND;
+	if (NetOpcodeIsRecv(opcode)) return NET_DIRECTION_RECV;
+	if (opcode == 0)
+	{
+		if (flags & NET_CLASS_LOCAL_SRC) return NET_DIRECTION_SEND;
+		if (flags & NET_CLASS_LOCAL_DST) return NET_DIRECTION_RECV;
+	}
+	return NET_DIRECTION_UNKNOWN;
+}
+
+static inline void AddRowBytes(const NetBatch * b, uint32_t i, NetBatchTotals * totals)
+{
+	uint64_t bytes = (uint64_t)b->size[i] * b->weight[i];
+
+	if (b->direction[i] == NET_DIRECTION_SEND) totals->SentBytes += bytes;
+	else if (b->direction[i] == NET_DIRECTION_RECV) totals->RecvBytes += bytes;
+	else return;
+
+	if ((b->flags[i] & NET_CLASS_LOOPBACK) != 0 ||
+		(b->flags[i] & (NET_CLASS_LOCAL_SRC | NET_CLASS_LOCAL_DST)) == (NET_CLASS_LOCAL_SRC | NET_CLASS_LOCAL_DST))
+	{
+		totals->LocalBytes += bytes;
+	}
+}
+
+static void SwapPortsScalar(uint16_t * ports, uint32_t begin, uint32_t end)
+{
+	for (uint32_t i = begin; i < end; i++) ports[i] = (uint16_t)((ports[i] >> 8) | (ports[i] << 8));
+}
+
+//IPv4 rows in [begin, end); IPv6 rows are left to Classify6
+static void Classify4Scalar(NetBatch * b, const NetLocalAddresses & local, uint32_t begin, uint32_t end, NetBatchTotals * totals)
+{
+	for (uint32_t i = begin; i < end; i++)
+	{
+		uint32_t s = b->saddr4[i];
+		uint32_t d = b->daddr4[i];
+		uint8_t f = 0;
+
+		if (b->ip6[i]) continue;
+
+		for (uint32_t k = 0; k < local.count4; k++)
+		{
+			if (s == local.v4[k]) f |= NET_CLASS_LOCAL_SRC;
+			if (d == local.v4[k]) f |= NET_CLASS_LOCAL_DST;
+		}
+		if ((s & NET_V4_FIRST_BYTE) == NET_V4_LOOPBACK || (d & NET_V4_FIRST_BYTE) == NET_V4_LOOPBACK) f |= NET_CLASS_LOOPBACK;
+		if ((d & NET_V4_MULTICAST_MASK) == NET_V4_MULTICAST) f |= NET_CLASS_MULTICAST;
+
+		b->flags[i] = f;
+		b->direction[i] = RowDirection(b->opcode[i], f);
+		AddRowBytes(b, i, totals);
+	}
+}
+
+static bool IsLoopback6(const uint8_t * addr)
+{
+	static const uint8_t loopback[16] = { 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,1 };
+	return memcmp(addr, loopback, 16) == 0;
+}
+
+//IPv6 rows of the whole block; they are a minority of the traffic and are left to plain code for every instruction set
+static void Classify6(NetBatch * b, const NetLocalAddresses & local, NetBatchTotals * totals)
+{
+	for (uint32_t i = 0; i < b->count; i++)
+	{
+		uint8_t f = NET_CLASS_IP6;
+
+		if (!b->ip6[i]) continue;
+
+		for (uint32_t k = 0; k < local.count6; k++)
+		{
+			if (memcmp(b->saddr6[i], local.v6[k], 16) == 0) f |= NET_CLASS_LOCAL_SRC;
+			if (memcmp(b->daddr6[i], local.v6[k], 16) == 0) f |= NET_CLASS_LOCAL_DST;
+		}
+		if (IsLoopback6(b->saddr6[i]) || IsLoopback6(b->daddr6[i])) f |= NET_CLASS_LOOPBACK;
+		if (b->daddr6[i][0] == 0xFF) f |= NET_CLASS_MULTICAST;
+
+		b->flags[i] = f;
+		b->direction[i] = RowDirection(b->opcode[i], f);
+		AddRowBytes(b, i, totals);
+	}
+}
+
+#ifdef NET_BATCH_X86
+
+/* ****** SSE4.1 kernels ****** */
+
+//Returns the number of ports swapped, a multiple of 8
+NET_TARGET("sse4.1")
+static uint32_t SwapPortsSse41(uint16_t * ports, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i *)&ports[i]);
+		_mm_storeu_si128((__m128i *)&ports[i], _mm_or_si128(_mm_slli_epi16(p, 8), _mm_srli_epi16(p, 8)));
+	}
+	return i;
+}
+
+// Classifies 4 rows per iteration: every comparison yields an all-ones lane mask, masks are combined into
+// direction and flags, and weighted sizes are summed as 64-bit products of the even and odd lanes.
+// Returns the number of rows handled, a multiple of 4.
+
+NET_TARGET("sse4.1")
+static uint32_t Classify4Sse41(NetBatch * b, const NetLocalAddresses & local, NetBatchTotals * totals)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i FirstByte = _mm_set1_epi32(NET_V4_FIRST_BYTE);
+	const __m128i loopback = _mm_set1_epi32(NET_V4_LOOPBACK);
+	const __m128i McastMask = _mm_set1_epi32(NET_V4_MULTICAST_MASK);
+	const __m128i mcast = _mm_set1_epi32(NET_V4_MULTICAST);
+	const __m128i OpSend = _mm_set1_epi32(NET_OPCODE_SEND);
+	const __m128i OpSend6 = _mm_set1_epi32(NET_OPCODE_SEND_IP6);
+	const __m128i OpRecv = _mm_set1_epi32(NET_OPCODE_RECV);
+	const __m128i OpRecv6 = _mm_set1_epi32(NET_OPCODE_RECV_IP6);
+	__m128i sent = zero;
+	__m128i recv = zero;
+	__m128i host = zero;
+	uint64_t sums[2];
+	uint32_t i;
+
+	for (i = 0; i + 4 <= b->count; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)&b->saddr4[i]);
+		__m128i d = _mm_loadu_si128((const __m128i *)&b->daddr4[i]);
+		int32_t op4, ip4;
+		__m128i op, v6, ls, ld, lo, mc, snd, rcv, none, hl, dir, flags, packed, size, weight, even, odd;
+
+		memcpy(&op4, &b->opcode[i], 4);
+		memcpy(&ip4, &b->ip6[i], 4);
+		op = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(op4));
+		v6 = _mm_cmpgt_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(ip4)), zero);
+
+		ls = zero;
+		ld = zero;
+		for (uint32_t k = 0; k < local.count4; k++)
+		{
+			__m128i a = _mm_set1_epi32((int)local.v4[k]);
+			ls = _mm_or_si128(ls, _mm_cmpeq_epi32(s, a));
+			ld = _mm_or_si128(ld, _mm_cmpeq_epi32(d, a));
+		}
+		lo = _mm_or_si128(_mm_cmpeq_epi32(_mm_and_si128(s, FirstByte), loopback),
+			_mm_cmpeq_epi32(_mm_and_si128(d, FirstByte), loopback));
+		mc = _mm_cmpeq_epi32(_mm_and_si128(d, McastMask), mcast);
+
+		none = _mm_cmpeq_epi32(op, zero);
+		snd = _mm_or_si128(_mm_cmpeq_epi32(op, OpSend), _mm_cmpeq_epi32(op, OpSend6));
+		rcv = _mm_or_si128(_mm_cmpeq_epi32(op, OpRecv), _mm_cmpeq_epi32(op, OpRecv6));
+		snd = _mm_or_si128(snd, _mm_and_si128(none, ls));
+		rcv = _mm_or_si128(rcv, _mm_andnot_si128(ls, _mm_and_si128(none, ld)));
+		snd = _mm_andnot_si128(v6, snd);
+		rcv = _mm_andnot_si128(v6, rcv);
+		hl = _mm_and_si128(_mm_or_si128(lo, _mm_and_si128(ls, ld)), _mm_or_si128(snd, rcv));
+
+		dir = _mm_or_si128(_mm_and_si128(snd, _mm_set1_epi32(NET_DIRECTION_SEND)), _mm_and_si128(rcv, _mm_set1_epi32(NET_DIRECTION_RECV)));
+		flags = _mm_or_si128(_mm_or_si128(_mm_and_si128(ls, _mm_set1_epi32(NET_CLASS_LOCAL_SRC)), _mm_and_si128(ld, _mm_set1_epi32(NET_CLASS_LOCAL_DST))),
+			_mm_or_si128(_mm_and_si128(lo, _mm_set1_epi32(NET_CLASS_LOOPBACK)), _mm_and_si128(mc, _mm_set1_epi32(NET_CLASS_MULTICAST))));
+		flags = _mm_andnot_si128(v6, flags);
+
+		//bytes 0-3: direction, 4-7: flags
+		packed = _mm_packus_epi16(_mm_packus_epi32(dir, flags), zero);
+		op4 = _mm_cvtsi128_si32(packed);
+		ip4 = _mm_cvtsi128_si32(_mm_srli_si128(packed, 4));
+		memcpy(&b->direction[i], &op4, 4);
+		memcpy(&b->flags[i], &ip4, 4);
+
+		size = _mm_loadu_si128((const __m128i *)&b->size[i]);
+		weight = _mm_loadu_si128((const __m128i *)&b->weight[i]);
+		even = _mm_mul_epu32(size, weight);
+		odd = _mm_mul_epu32(_mm_srli_epi64(size, 32), _mm_srli_epi64(weight, 32));
+		sent = _mm_add_epi64(sent, _mm_and_si128(even, _mm_shuffle_epi32(snd, _MM_SHUFFLE(2, 2, 0, 0))));
+		sent = _mm_add_epi64(sent, _mm_and_si128(odd, _mm_shuffle_epi32(snd, _MM_SHUFFLE(3, 3, 1, 1))));
+		recv = _mm_add_epi64(recv, _mm_and_si128(even, _mm_shuffle_epi32(rcv, _MM_SHUFFLE(2, 2, 0, 0))));
+		recv = _mm_add_epi64(recv, _mm_and_si128(odd, _mm_shuffle_epi32(rcv, _MM_SHUFFLE(3, 3, 1, 1))));
+		host = _mm_add_epi64(host, _mm_and_si128(even, _mm_shuffle_epi32(hl, _MM_SHUFFLE(2, 2, 0, 0))));
+		host = _mm_add_epi64(host, _mm_and_si128(odd, _mm_shuffle_epi32(hl, _MM_SHUFFLE(3, 3, 1, 1))));
+	}
+
+	_mm_storeu_si128((__m128i *)sums, sent);
+	totals->SentBytes += sums[0] + sums[1];
+	_mm_storeu_si128((__m128i *)sums, recv);
+	totals->RecvBytes += sums[0] + sums[1];
+	_mm_storeu_si128((__m128i *)sums, host);
+	totals->LocalBytes += sums[0] + sums[1];
+	return i;
+}
+
+/* ****** AVX2 kernels ****** */
+
+NET_TARGET("avx2")
+static uint32_t SwapPortsAvx2(uint16_t * ports, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 0; i + 16 <= count; i += 16)
+	{
+		__m256i p = _mm256_loadu_si256((const __m256i *)&ports[i]);
+		_mm256_storeu_si256((__m256i *)&ports[i], _mm256_or_si256(_mm256_slli_epi16(p, 8), _mm256_srli_epi16(p, 8)));
+	}
+	return i;
+}
+
+//Same as Classify4Sse41 with 8 rows per iteration
+NET_TARGET("avx2")
+static uint32_t Classify4Avx2(NetBatch * b, const NetLocalAddresses & local, NetBatchTotals * totals)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i FirstByte = _mm256_set1_epi32(NET_V4_FIRST_BYTE);
+	const __m256i loopback = _mm256_set1_epi32(NET_V4_LOOPBACK);
+	const __m256i McastMask = _mm256_set1_epi32(NET_V4_MULTICAST_MASK);
+	const __m256i mcast = _mm256_set1_epi32(NET_V4_MULTICAST);
+	const __m256i OpSend = _mm256_set1_epi32(NET_OPCODE_SEND);
+	const __m256i OpSend6 = _mm256_set1_epi32(NET_OPCODE_SEND_IP6);
+	const __m256i OpRecv = _mm256_set1_epi32(NET_OPCODE_RECV);
+	const __m256i OpRecv6 = _mm256_set1_epi32(NET_OPCODE_RECV_IP6);
+	__m256i sent = zero;
+	__m256i recv = zero;
+	__m256i host = zero;
+	uint64_t sums[4];
+	uint32_t i;
+
+	for (i = 0; i + 8 <= b->count; i += 8)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)&b->saddr4[i]);
+		__m256i d = _mm256_loadu_si256((const __m256i *)&b->daddr4[i]);
+		__m256i op, v6, ls, ld, lo, mc, snd, rcv, none, hl, dir, flags, size, weight, even, odd;
+		__m128i packed;
+
+		op = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&b->opcode[i]));
+		v6 = _mm256_cmpgt_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&b->ip6[i])), zero);
+
+		ls = zero;
+		ld = zero;
+		for (uint32_t k = 0; k < local.count4; k++)
+		{
+			__m256i a = _mm256_set1_epi32((int)local.v4[k]);
+			ls = _mm256_or_si256(ls, _mm256_cmpeq_epi32(s, a));
+			ld = _mm256_or_si256(ld, _mm256_cmpeq_epi32(d, a));
+		}
+		lo = _mm256_or_si256(_mm256_cmpeq_epi32(_mm256_and_si256(s, FirstByte), loopback),
+			_mm256_cmpeq_epi32(_mm256_and_si256(d, FirstByte), loopback));
+		mc = _mm256_cmpeq_epi32(_mm256_and_si256(d, McastMask), mcast);
+
+		none = _mm256_cmpeq_epi32(op, zero);
+		snd = _mm256_or_si256(_mm256_cmpeq_epi32(op, OpSend), _mm256_cmpeq_epi32(op, OpSend6));
+		rcv = _mm256_or_si256(_mm256_cmpeq_epi32(op, OpRecv), _mm256_cmpeq_epi32(op, OpRecv6));
+		snd = _mm256_or_si256(snd, _mm256_and_si256(none, ls));
+		rcv = _mm256_or_si256(rcv, _mm256_andnot_si256(ls, _mm256_and_si256(none, ld)));
+		snd = _mm256_andnot_si256(v6, snd);
+		rcv = _mm256_andnot_si256(v6, rcv);
+		hl = _mm256_and_si256(_mm256_or_si256(lo, _mm256_and_si256(ls, ld)), _mm256_or_si256(snd, rcv));
+
+		dir = _mm256_or_si256(_mm256_and_si256(snd, _mm256_set1_epi32(NET_DIRECTION_SEND)), _mm256_and_si256(rcv, _mm256_set1_epi32(NET_DIRECTION_RECV)));
+		flags = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(ls, _mm256_set1_epi32(NET_CLASS_LOCAL_SRC)), _mm256_and_si256(ld, _mm256_set1_epi32(NET_CLASS_LOCAL_DST))),
+			_mm256_or_si256(_mm256_and_si256(lo, _mm256_set1_epi32(NET_CLASS_LOOPBACK)), _mm256_and_si256(mc, _mm256_set1_epi32(NET_CLASS_MULTICAST))));
+		flags = _mm256_andnot_si256(v6, flags);
+
+		//256-bit packs work within 128-bit halves, so the halves are packed with SSE instead
+		packed = _mm_packus_epi32(_mm256_castsi256_si128(dir), _mm256_extracti128_si256(dir, 1));
+		_mm_storel_epi64((__m128i *)&b->direction[i], _mm_packus_epi16(packed, packed));
+		packed = _mm_packus_epi32(_mm256_castsi256_si128(flags), _mm256_extracti128_si256(flags, 1));
+		_mm_storel_epi64((__m128i *)&b->flags[i], _mm_packus_epi16(packed, packed));
+
+		size = _mm256_loadu_si256((const __m256i *)&b->size[i]);
+		weight = _mm256_loadu_si256((const __m256i *)&b->weight[i]);
+		even = _mm256_mul_epu32(size, weight);
+		odd = _mm256_mul_epu32(_mm256_srli_epi64(size, 32), _mm256_srli_epi64(weight, 32));
+		sent = _mm256_add_epi64(sent, _mm256_and_si256(even, _mm256_shuffle_epi32(snd, _MM_SHUFFLE(2, 2, 0, 0))));
+		sent = _mm256_add_epi64(sent, _mm256_and_si256(odd, _mm256_shuffle_epi32(snd, _MM_SHUFFLE(3, 3, 1, 1))));
+		recv = _mm256_add_epi64(recv, _mm256_and_si256(even, _mm256_shuffle_epi32(rcv, _MM_SHUFFLE(2, 2, 0, 0))));
+		recv = _mm256_add_epi64(recv, _mm256_and_si256(odd, _mm256_shuffle_epi32(rcv, _MM_SHUFFLE(3, 3, 1, 1))));
+		host = _mm256_add_epi64(host, _mm256_and_si256(even, _mm256_shuffle_epi32(hl, _MM_SHUFFLE(2, 2, 0, 0))));
+		host = _mm256_add_epi64(host, _mm256_and_si256(odd, _mm256_shuffle_epi32(hl, _MM_SHUFFLE(3, 3, 1, 1))));
+	}
+
+	_mm256_storeu_si256((__m256i *)sums, sent);
+	totals->SentBytes += sums[0] + sums[1] + sums[2] + sums[3];
+	_mm256_storeu_si256((__m256i *)sums, recv);
+	totals->RecvBytes += sums[0] + sums[1] + sums[2] + sums[3];
+	_mm256_storeu_si256((__m256i *)sums, host);
+	totals->LocalBytes += sums[0] + sums[1] + sums[2] + sums[3];
+	return i;
+}
+
+/* ****** CPU detection ****** */
+
+static void CpuId(int leaf, int subleaf, int regs[4])
+{
+#ifdef _MSC_VER
+	__cpuidex(regs, leaf, subleaf);
+#else
+	unsigned int a = 0, b = 0, c = 0, d = 0;
+	__cpuid_count(leaf, subleaf, a, b, c, d);
+	regs[0] = (int)a; regs[1] = (int)b; regs[2] = (int)c; regs[3] = (int)d;
+#endif
+}
+
+//XCR0: which register states the OS saves on context switches
+static uint64_t XGetBv()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t a, d;
+	__asm__ volatile("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+	return ((uint64_t)d << 32) | a;
+#endif
+}
+
+NetBatchIsa NetBatchSupportedIsa()
+{
+	int regs[4];
+	int MaxLeaf;
+	bool sse41, avx;
+
+	CpuId(0, 0, regs);
+	MaxLeaf = regs[0];
+	if (MaxLeaf < 1) return NetBatchScalar;
+
+	CpuId(1, 0, regs);
+	sse41 = (regs[2] & (1 << 19)) != 0;
+	avx = (regs[2] & (1 << 27)) != 0 && (regs[2] & (1 << 28)) != 0 && (XGetBv() & 6) == 6; //OSXSAVE, AVX, XMM and YMM state
+	if (avx && MaxLeaf >= 7)
+	{
+		CpuId(7, 0, regs);
+		if (regs[1] & (1 << 5)) return NetBatchAvx2;
+	}
+	return sse41 ? NetBatchSse41 : NetBatchScalar;
+}
+
+#else
+
+NetBatchIsa NetBatchSupportedIsa()
+{
+	return NetBatchScalar;
+}
+
+#endif
+
+/* ****** Dispatch ****** */
+
+NetBatchIsa NetBatchGetIsa()
+{
+	if (SelectedIsa < 0) SelectedIsa = NetBatchSupportedIsa(); //racing threads store the same value
+	return (NetBatchIsa)SelectedIsa;
+}
+
+void NetBatchSetIsa(NetBatchIsa isa)
+{
+	NetBatchIsa supported = NetBatchSupportedIsa();
+	SelectedIsa = isa < supported ? isa : supported;
+}
+
+void NetBatchProcess(NetBatch * b, const NetLocalAddresses & local, NetBatchTotals * totals)
+{
+	uint32_t ports = 0;
+	uint32_t rows = 0;
+
+	switch (NetBatchGetIsa())
+	{
+#ifdef NET_BATCH_X86
+	case NetBatchAvx2:
+		ports = SwapPortsAvx2(b->sport, b->count);
+		SwapPortsAvx2(b->dport, b->count);
+		rows = Classify4Avx2(b, local, totals);
+		break;
+
+	case NetBatchSse41:
+		ports = SwapPortsSse41(b->sport, b->count);
+		SwapPortsSse41(b->dport, b->count);
+		rows = Classify4Sse41(b, local, totals);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	//remainders that don't fill a vector
+	SwapPortsScalar(b->sport, ports, b->count);
+	SwapPortsScalar(b->dport, ports, b->count);
+	Classify4Scalar(b, local, rows, b->count, totals);
+	Classify6(b, local, totals);
+}
+
+} // END NAMESPACE
@@ -0,0 +1,96 @@
+//Batch classification of network records: port byte order, direction, local/loopback/multicast addresses, byte totals
+#pragma once
+
+#include <stdint.h>
+
+#include "NetRecord.h"
+
+namespace EtwNetwork
+{
+
+#define NET_BATCH_SIZE 4096 //records per block
+
+//Same values as TrafficLib.TrafficDirections
+#define NET_DIRECTION_UNKNOWN 0
+#define NET_DIRECTION_SEND 1
+#define NET_DIRECTION_RECV 2
+
+//Address classes of a record
+#define NET_CLASS_LOCAL_SRC 0x01 //source address is in the local address list
+#define NET_CLASS_LOCAL_DST 0x02 //destination address is in the local address list
+#define NET_CLASS_LOOPBACK 0x04 //source or destination is a loopback address (127.0.0.0/8, ::1)
+#define NET_CLASS_MULTICAST 0x08 //destination is a multicast address (224.0.0.0/4, ff00::/8)
+#define NET_CLASS_IP6 0x10
+
+#define NET_LOCAL_MAX4 32
+#define NET_LOCAL_MAX6 16
+
+//Addresses of the local interfaces, as returned by NetworkStats.GetLocalAddresses
+struct NetLocalAddresses
+{
+	uint32_t count4;
+	uint32_t count6;
+	uint32_t v4[NET_LOCAL_MAX4]; //as stored in memory (network byte order)
+	uint8_t v6[NET_LOCAL_MAX6][16];
+};
+
+void NetLocalAddressesClear(NetLocalAddresses * local);
+bool NetLocalAddressesAdd(NetLocalAddresses * local, const uint8_t * addr, bool ip6); //false if the list is full
+
+// Block of records in structure-of-arrays form, so that the kernels work on whole columns.
+// Rows are appended with NetBatchAppendEvent/NetBatchAppendRecord; NetBatchProcess fills "direction" and
+// "flags". Ports are kept as logged (network byte order) until NetBatchProcess swaps them in place.
+
+struct NetBatch
+{
+	uint32_t count;
+
+	//Input columns
+	uint32_t size[NET_BATCH_SIZE];
+	uint32_t weight[NET_BATCH_SIZE];
+	uint32_t saddr4[NET_BATCH_SIZE]; //first 4 bytes of the address, IPv4 addresses as stored in memory
+	uint32_t daddr4[NET_BATCH_SIZE];
+	uint16_t sport[NET_BATCH_SIZE];
+	uint16_t dport[NET_BATCH_SIZE];
+	uint8_t opcode[NET_BATCH_SIZE]; //0 = no opcode, the direction is derived from the local addresses
+	uint8_t ip6[NET_BATCH_SIZE];
+	uint8_t saddr6[NET_BATCH_SIZE][16]; //filled for IPv6 rows only
+	uint8_t daddr6[NET_BATCH_SIZE][16];
+
+	//Output columns
+	uint8_t direction[NET_BATCH_SIZE]; //NET_DIRECTION_*
+	uint8_t flags[NET_BATCH_SIZE]; //NET_CLASS_*
+};
+
+struct NetBatchTotals
+{
+	uint64_t SentBytes; //weighted
+	uint64_t RecvBytes;
+	uint64_t LocalBytes; //part of the sent and received bytes that stayed on this computer: loopback, or both ends local
+};
+
+// Appends the fields shared by all TcpIp/UdpIp layouts straight from the event UserData, like DecodeNetRecord
+// but without swapping the ports. Returns false if the block is full or the event does not follow the layout.
+bool NetBatchAppendEvent(NetBatch * b, uint8_t opcode, const uint8_t * pUserData, uint32_t UserDataLength, uint32_t weight);
+
+bool NetBatchAppendRecord(NetBatch * b, const NetRecord & rec); //false if the block is full
+
+// Runs the kernels over the block, once per block: swaps the ports to host byte order, classifies the
+// addresses against "local", derives the direction of every row and adds the weighted bytes sent, received
+// and exchanged between local addresses to "totals". Send/receive opcodes decide the direction; rows without an opcode are sent if the
+// source is local and received if the destination is, the way Ip4Packet does it.
+void NetBatchProcess(NetBatch * b, const NetLocalAddresses & local, NetBatchTotals * totals);
+
+//Instruction sets of the kernels
+enum NetBatchIsa
+{
+	NetBatchScalar = 0,
+	NetBatchSse41 = 1,
+	NetBatchAvx2 = 2
+};
+
+NetBatchIsa NetBatchSupportedIsa(); //best instruction set of this CPU
+NetBatchIsa NetBatchGetIsa(); //instruction set in use; the best supported one by default
+void NetBatchSetIsa(NetBatchIsa isa); //limited to the supported ones; for comparisons
+
+} // END NAMESPACE
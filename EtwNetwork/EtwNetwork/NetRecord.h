@@ -0,0 +1,163 @@
+//Native representation of a TCP/IP or UDP/IP kernel event
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+namespace EtwNetwork
+{
+
+//Opcodes of Microsoft-Windows-Kernel-Network MOF events (TcpIp and UdpIp classes)
+//https://msdn.microsoft.com/en-us/library/windows/desktop/aa364128(v=vs.85).aspx
+
+#define NET_OPCODE_SEND 10
+#define NET_OPCODE_RECV 11
+#define NET_OPCODE_CONNECT 12
+#define NET_OPCODE_DISCONNECT 13
+#define NET_OPCODE_RETRANSMIT 14
+#define NET_OPCODE_ACCEPT 15
+#define NET_OPCODE_RECONNECT 16
+#define NET_OPCODE_FAIL 17
+#define NET_OPCODE_TCPCOPY 18
+#define NET_OPCODE_SEND_IP6 26
+#define NET_OPCODE_RECV_IP6 27
+#define NET_OPCODE_CONNECT_IP6 28
+#define NET_OPCODE_DISCONNECT_IP6 29
+#define NET_OPCODE_RETRANSMIT_IP6 30
+#define NET_OPCODE_ACCEPT_IP6 31
+#define NET_OPCODE_RECONNECT_IP6 32
+#define NET_OPCODE_TCPCOPY_IP6 34
+
+#define NET_PROTO_TCP 6
+#define NET_PROTO_UDP 17
+
+struct NetRecord
+{
+	uint64_t timestamp; //FILETIME of the event (100 ns units)
+	uint32_t pid;
+	uint32_t size;
+	uint8_t daddr[16]; //IPv4 addresses occupy the first 4 bytes
+	uint8_t saddr[16];
+	uint16_t dport; //host byte order
+	uint16_t sport;
+	uint8_t opcode;
+	uint8_t proto; //NET_PROTO_TCP or NET_PROTO_UDP
+	uint8_t ip6; //non-zero for IPv6 events
+	uint8_t reserved;
+	uint32_t weight; //how many original events this record stands for (1 if not sampled)
+};
+
+inline bool NetOpcodeIsIp6(uint8_t opcode)
+{
+	return opcode >= NET_OPCODE_SEND_IP6 && opcode <= NET_OPCODE_TCPCOPY_IP6;
+}
+
+inline bool NetOpcodeIsSend(uint8_t opcode)
+{
+	return opcode == NET_OPCODE_SEND || opcode == NET_OPCODE_SEND_IP6;
+}
+
+inline bool NetOpcodeIsRecv(uint8_t opcode)
+{
+	return opcode == NET_OPCODE_RECV || opcode == NET_OPCODE_RECV_IP6;
+}
+
+//Send and receive events carry the payload; everything else changes connection state
+inline bool NetOpcodeIsData(uint8_t opcode)
+{
+	return NetOpcodeIsSend(opcode) || NetOpcodeIsRecv(opcode);
+}
+
+inline uint16_t NetSwapPort(const uint8_t * p)
+{
+	return (uint16_t)((p[0] << 8) | p[1]); //ports are logged in network byte order
+}
+
+// Decodes the fields shared by all TcpIp/UdpIp event layouts (PID, size, daddr, saddr, dport, sport).
+// These always come first in the UserData, so their offsets only depend on the address family.
+// Returns false for events that do not follow this layout (for example, the Fail event).
+
+inline bool DecodeNetRecord(uint8_t proto, uint8_t opcode, const uint8_t * pUserData, uint32_t UserDataLength,
+							NetRecord * rec)
+{
+	uint32_t AddrLength;
+
+	if (opcode < NET_OPCODE_SEND || opcode == NET_OPCODE_FAIL || opcode > NET_OPCODE_TCPCOPY_IP6) return false;
+	if (opcode > NET_OPCODE_TCPCOPY && opcode < NET_OPCODE_SEND_IP6) return false;
+
+	AddrLength = NetOpcodeIsIp6(opcode) ? 16 : 4;
+	if (UserDataLength < 12 + 2 * AddrLength) return false;
+
+	memset(rec, 0, sizeof(NetRecord));
+	memcpy(&rec->pid, pUserData, 4);
+	memcpy(&rec->size, pUserData + 4, 4);
+	memcpy(rec->daddr, pUserData + 8, AddrLength);
+	memcpy(rec->saddr, pUserData + 8 + AddrLength, AddrLength);
+	rec->dport = NetSwapPort(pUserData + 8 + 2 * AddrLength);
+	rec->sport = NetSwapPort(pUserData + 10 + 2 * AddrLength);
+	rec->opcode = opcode;
+	rec->proto = proto;
+	rec->ip6 = (AddrLength == 16);
+	rec->weight = 1;
+	return true;
+}
+
+//Fields of send/receive events that identify the connection, kept apart from NetRecord
+struct NetConnection
+{
+	uint64_t connid; //connection object address
+	uint32_t seqnum;
+};
+
+// Decodes seqnum and connid, which follow the common fields in the version 2 send/receive layouts
+// (TCP send events have startime and endtime in between). Returns false for other events.
+
+inline bool DecodeNetConnection(uint8_t proto, uint8_t opcode, const uint8_t * pUserData, uint32_t UserDataLength,
+								uint32_t PointerSize, NetConnection * conn)
+{
+	uint32_t offset;
+	uint32_t connid32;
+
+	if (!NetOpcodeIsData(opcode) || (PointerSize != 4 && PointerSize != 8)) return false;
+
+	offset = 12 + 2 * (NetOpcodeIsIp6(opcode) ? 16 : 4);
+	if (proto == NET_PROTO_TCP && NetOpcodeIsSend(opcode)) offset += 8;
+	if (UserDataLength < offset + 4 + PointerSize) return false;
+
+	memcpy(&conn->seqnum, pUserData + offset, 4);
+	if (PointerSize == 8) memcpy(&conn->connid, pUserData + offset + 4, 8);
+	else
+	{
+		memcpy(&connid32, pUserData + offset + 4, 4);
+		conn->connid = connid32;
+	}
+	return true;
+}
+
+//Hash of the flow (process, protocol, addresses and ports) the record belongs to; direction-independent
+inline uint32_t NetRecordFlowHash(const NetRecord * rec)
+{
+	uint64_t h = 14695981039346656037ULL; //FNV-1a
+	uint32_t AddrLength = rec->ip6 ? 16 : 4;
+	const uint8_t * a = rec->saddr;
+	const uint8_t * b = rec->daddr;
+	uint16_t pa = rec->sport;
+	uint16_t pb = rec->dport;
+	uint32_t i;
+
+	//order endpoints so that both directions of a connection map to the same flow
+	if (memcmp(a, b, AddrLength) > 0 || (memcmp(a, b, AddrLength) == 0 && pa > pb))
+	{
+		a = rec->daddr; b = rec->saddr;
+		pa = rec->dport; pb = rec->sport;
+	}
+
+	for (i = 0; i < AddrLength; i++) { h ^= a[i]; h *= 1099511628211ULL; }
+	for (i = 0; i < AddrLength; i++) { h ^= b[i]; h *= 1099511628211ULL; }
+	h ^= ((uint64_t)pa << 16) | pb; h *= 1099511628211ULL;
+	h ^= ((uint64_t)rec->pid << 8) | rec->proto; h *= 1099511628211ULL;
+
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+} // END NAMESPACE
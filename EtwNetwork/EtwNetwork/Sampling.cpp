@@ -0,0 +1,132 @@
+//Adaptive sampling of network events under overload
+
+#include "Sampling.h"
+
+namespace EtwNetwork
+{
+
+#define SAMPLING_WINDOW 1000000 //period is reconsidered every 100 ms
+
+AdaptiveSampler::AdaptiveSampler()
+{
+	mode = SamplingOff;
+	MaxPeriod = 64;
+	MaxLag = 20000000; //2 s
+	MaxLoad = 80;
+	MaxQueue = 50;
+	FlushDelay = 10000000; //1 s, the default flush timer of real-time sessions
+	Reset(0x2545F4914F6CDD1DULL, 0);
+}
+
+void AdaptiveSampler::Reset(uint64_t seed, uint64_t now)
+{
+	period = 1;
+	EventsSeen = 0;
+	EventsSampled = 0;
+	EventsLost = 0;
+
+	rng = seed ? seed : 0x2545F4914F6CDD1DULL;
+	salt = (uint32_t)(seed ^ (seed >> 32));
+	AvgLag = 0;
+	BusyTime = 0;
+	WindowStart = now;
+	QueuePercent = 0;
+	LostInWindow = false;
+}
+
+uint32_t AdaptiveSampler::SampleEvent()
+{
+	EventsSeen++;
+	EventsSampled++;
+
+	if (mode == SamplingOff || period <= 1) return 1;
+
+	//xorshift64
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	if (((uint32_t)(rng >> 32) & (period - 1)) != 0)
+	{
+		EventsSampled--;
+		return 0;
+	}
+	return period;
+}
+
+uint32_t AdaptiveSampler::SampleFlow(uint32_t FlowHash)
+{
+	uint32_t h;
+
+	EventsSeen++;
+	EventsSampled++;
+
+	if (mode == SamplingOff || period <= 1) return 1;
+
+	//salted finalizer, so the set of sampled flows differs between sessions.
+	//Flows kept at period 2N are a subset of flows kept at period N.
+	h = FlowHash ^ salt;
+	h ^= h >> 16; h *= 0x85EBCA6B;
+	h ^= h >> 13; h *= 0xC2B2AE35;
+	h ^= h >> 16;
+	if ((h & (period - 1)) != 0)
+	{
+		EventsSampled--;
+		return 0;
+	}
+	return period;
+}
+
+void AdaptiveSampler::Observe(uint64_t now, uint64_t lag, uint64_t latency)
+{
+	lag = lag > FlushDelay ? lag - FlushDelay : 0; //events wait for the flush even when we keep up
+	AvgLag += ((int64_t)lag - AvgLag) / 16;
+	BusyTime += latency;
+
+	if (now - WindowStart >= SAMPLING_WINDOW) Adjust(now);
+}
+
+void AdaptiveSampler::ObserveQueue(uint32_t BuffersInUse, uint32_t NumberOfBuffers, uint32_t BuffersFilling, uint64_t lost)
+{
+	// Buffers being filled are in use even on an idle system; only the rest wait for delivery.
+
+	if (NumberOfBuffers > BuffersFilling)
+	{
+		BuffersInUse = BuffersInUse > BuffersFilling ? BuffersInUse - BuffersFilling : 0;
+		QueuePercent = (BuffersInUse * 100) / (NumberOfBuffers - BuffersFilling);
+	}
+
+	if (lost > EventsLost)
+	{
+		EventsLost = lost;
+		LostInWindow = true;
+	}
+}
+
+// Doubles the period when any of the overload signals fires and halves it
+// when all of them are well below their limits.
+
+void AdaptiveSampler::Adjust(uint64_t now)
+{
+	uint64_t load = (BusyTime * 100) / (now - WindowStart);
+	uint64_t lag = AvgLag > 0 ? (uint64_t)AvgLag : 0;
+
+	if (mode == SamplingOff)
+	{
+		period = 1;
+	}
+	else if (LostInWindow || lag > MaxLag || load > MaxLoad || QueuePercent > MaxQueue)
+	{
+		if (period < MaxPeriod) period *= 2;
+	}
+	else if (lag < MaxLag / 4 && load < MaxLoad / 3 && QueuePercent < MaxQueue / 2)
+	{
+		if (period > 1) period /= 2;
+	}
+	if (period > MaxPeriod) period = MaxPeriod; //the maximum was lowered from another thread while doubling
+
+	BusyTime = 0;
+	WindowStart = now;
+	LostInWindow = false;
+}
+
+} // END NAMESPACE
@@ -0,0 +1,65 @@
+//Adaptive sampling of network events under overload
+#pragma once
+
+#include <stdint.h>
+
+namespace EtwNetwork
+{
+
+enum SamplingMode
+{
+	SamplingOff = 0, //every event is processed
+	SamplingPerEvent = 1, //each data event is kept independently with probability 1/period
+	SamplingPerFlow = 2 //all data events of a flow are kept or dropped together, flows chosen with probability 1/period
+};
+
+// Chooses which events are processed when the consumer can't keep up with the event rate.
+// The sampling period is always a power of 2 and every kept event is given weight = period,
+// so sums of (size * weight) are unbiased estimates of the real byte totals.
+// All times are in 100 ns units. Not thread-safe: must be called from the ETW processing thread only.
+
+class AdaptiveSampler
+{
+public:
+	//Settings
+	SamplingMode mode;
+	uint32_t MaxPeriod; //upper bound of the sampling period (power of 2)
+	uint64_t MaxLag; //events older than this when delivered mean we are falling behind
+	uint32_t MaxLoad; //allowed share of the wall time spent in the event callback, percent
+	uint32_t MaxQueue; //allowed share of ETW buffers waiting to be delivered, percent
+	uint64_t FlushDelay; //delivery delay the real-time session adds by itself (flush timer), not counted as lag
+
+	//Statistics
+	volatile uint32_t period; //current sampling period: 1 of "period" events (or flows) is kept
+	volatile uint64_t EventsSeen;
+	volatile uint64_t EventsSampled;
+	volatile uint64_t EventsLost; //events and buffers lost by ETW itself (kernel side)
+
+	AdaptiveSampler();
+
+	void Reset(uint64_t seed, uint64_t now);
+
+	//Return the weight of the event, or 0 if the event must be dropped
+	uint32_t SampleEvent();
+	uint32_t SampleFlow(uint32_t FlowHash);
+
+	//Called for every event with the delay between logging and delivery and the time spent processing it
+	void Observe(uint64_t now, uint64_t lag, uint64_t latency);
+
+	//Called when ETW delivers a buffer, with the state of the session buffers.
+	//BuffersFilling is the number of buffers being written rather than waiting (one per processor).
+	void ObserveQueue(uint32_t BuffersInUse, uint32_t NumberOfBuffers, uint32_t BuffersFilling, uint64_t lost);
+
+private:
+	uint64_t rng;
+	uint32_t salt;
+	int64_t AvgLag;
+	uint64_t BusyTime;
+	uint64_t WindowStart;
+	uint32_t QueuePercent;
+	bool LostInWindow;
+
+	void Adjust(uint64_t now);
+};
+
+} // END NAMESPACE
@@ -0,0 +1,595 @@
+//Publication of network events to other processes through a named shared-memory ring
+
+#include <string.h>
+#include <atomic>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <sddl.h>
+#pragma comment(lib, "Advapi32.lib")
+#else
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "SharedRing.h"
+
+namespace EtwNetwork
+{
+
+#define SHARED_RING_MAGIC 0x474E5245 //"ERNG"
+#define SHARED_RING_VERSION 1
+#define SHARED_RING_MAX_CAPACITY (1U << 24)
+
+#define SHARED_RING_ACTIVE 1
+#define SHARED_RING_CLOSED 2
+
+#ifdef _WIN32
+// Full access for SYSTEM, administrators and the creator, read access for any authenticated user: the
+// publisher usually runs elevated or as a service, its subscribers in other sessions and without elevation.
+#define SHARED_RING_SDDL "D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;OW)(A;;GR;;;AU)"
+#define SHARED_RING_INVALID ERROR_INVALID_DATA
+#define SHARED_RING_IN_USE ERROR_ALREADY_EXISTS
+#else
+#define SHARED_RING_INVALID EINVAL
+#define SHARED_RING_IN_USE EEXIST
+#endif
+
+// Layout of the shared memory: header followed by the slots.
+// Only 32-bit atomics are used, since 64-bit atomic loads on 32-bit x86 need write access to the memory.
+// Counters in shared memory are the low 32 bits of the 64-bit counters each side keeps for itself.
+
+struct SharedRingHeader
+{
+	std::atomic<uint32_t> magic; //set last when the ring is initialized
+	uint32_t version;
+	uint32_t capacity;
+	uint32_t SlotSize;
+	std::atomic<uint32_t> generation; //incremented every time a writer initializes the ring
+	std::atomic<uint32_t> state; //SHARED_RING_ACTIVE or SHARED_RING_CLOSED
+	uint32_t WriterPid; //process of the writer, to tell a live ring from one left by a dead writer
+	std::atomic<uint32_t> head; //records published
+	std::atomic<uint32_t> AggregatesSeq; //odd while the writer updates the aggregates
+	SharedAggregates aggregates;
+};
+
+struct SharedSlot
+{
+	std::atomic<uint32_t> seq; //2 * index + 2 once record "index" is complete, odd while it is written
+	uint32_t reserved;
+	NetRecord rec;
+};
+
+static inline SharedSlot * SlotsOf(const void * header)
+{
+	return (SharedSlot *)((uint8_t *)header + sizeof(SharedRingHeader));
+}
+
+/* ****** SharedMemory ****** */
+
+SharedMemory::SharedMemory()
+{
+	data = NULL;
+	size = 0;
+	error = 0;
+	existed = false;
+	handle = NULL;
+	fd = -1;
+	name[0] = 0;
+	owner = false;
+}
+
+SharedMemory::~SharedMemory()
+{
+	Close();
+}
+
+#ifdef _WIN32
+
+bool SharedMemory::Create(const char * name, size_t size)
+{
+	MEMORY_BASIC_INFORMATION info;
+	SECURITY_ATTRIBUTES sa;
+	PSECURITY_DESCRIPTOR sd = NULL;
+	DWORD status;
+
+	Close();
+
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(SHARED_RING_SDDL, SDDL_REVISION_1, &sd, NULL))
+	{
+		error = (int)GetLastError();
+		return false;
+	}
+	sa.nLength = sizeof(sa);
+	sa.lpSecurityDescriptor = sd;
+	sa.bInheritHandle = FALSE;
+
+	handle = CreateFileMappingA(INVALID_HANDLE_VALUE, &sa, PAGE_READWRITE,
+		(DWORD)((uint64_t)size >> 32), (DWORD)size, name);
+	status = GetLastError();
+	LocalFree(sd);
+	if (handle == NULL)
+	{
+		error = (int)status;
+		return false;
+	}
+	existed = (status == ERROR_ALREADY_EXISTS); //an existing section keeps the size and security it was created with
+
+	data = (uint8_t *)MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (data == NULL || VirtualQuery(data, &info, sizeof(info)) == 0)
+	{
+		error = (int)GetLastError();
+		Close();
+		return false;
+	}
+
+	this->size = info.RegionSize;
+	owner = true;
+	return true;
+}
+
+bool SharedMemory::Open(const char * name)
+{
+	MEMORY_BASIC_INFORMATION info;
+
+	Close();
+
+	handle = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+	if (handle == NULL)
+	{
+		error = (int)GetLastError();
+		return false;
+	}
+
+	data = (uint8_t *)MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0);
+	if (data == NULL || VirtualQuery(data, &info, sizeof(info)) == 0)
+	{
+		error = (int)GetLastError();
+		Close();
+		return false;
+	}
+
+	size = info.RegionSize;
+	return true;
+}
+
+void SharedMemory::Detach()
+{
+	Close(); //the section goes away with its last handle
+}
+
+void SharedMemory::Close()
+{
+	if (data != NULL) UnmapViewOfFile(data);
+	if (handle != NULL) CloseHandle(handle);
+	data = NULL;
+	handle = NULL;
+	size = 0;
+	owner = false;
+}
+
+#else
+
+bool SharedMemory::Create(const char * name, size_t size)
+{
+	struct stat st;
+
+	Close();
+
+	existed = false;
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0 && errno == EEXIST)
+	{
+		existed = true;
+		fd = shm_open(name, O_RDWR, 0);
+	}
+
+	//never shrunk: readers may still have the old size mapped
+	if (fd < 0 || fstat(fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate(fd, (off_t)size) != 0))
+	{
+		error = errno;
+		Close();
+		return false;
+	}
+	if ((size_t)st.st_size > size) size = (size_t)st.st_size;
+
+	data = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == (uint8_t *)MAP_FAILED)
+	{
+		error = errno;
+		data = NULL;
+		Close();
+		return false;
+	}
+
+	this->size = size;
+	strncpy(this->name, name, sizeof(this->name) - 1);
+	this->name[sizeof(this->name) - 1] = 0;
+	owner = true;
+	return true;
+}
+
+bool SharedMemory::Open(const char * name)
+{
+	struct stat st;
+
+	Close();
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		error = errno;
+		Close();
+		return false;
+	}
+
+	data = (uint8_t *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == (uint8_t *)MAP_FAILED)
+	{
+		error = errno;
+		data = NULL;
+		Close();
+		return false;
+	}
+
+	size = (size_t)st.st_size;
+	return true;
+}
+
+void SharedMemory::Detach()
+{
+	owner = false;
+	Close();
+}
+
+void SharedMemory::Close()
+{
+	if (data != NULL) munmap(data, size);
+	if (fd >= 0) close(fd);
+	if (owner) shm_unlink(name); //readers keep their mappings, the name goes away with the writer
+	data = NULL;
+	fd = -1;
+	size = 0;
+	owner = false;
+}
+
+#endif
+
+/* ****** Writer ****** */
+
+#ifdef _WIN32
+
+static uint32_t CurrentProcess()
+{
+	return (uint32_t)GetCurrentProcessId();
+}
+
+static bool ProcessAlive(uint32_t pid)
+{
+	HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+	DWORD res;
+
+	if (process == NULL) return GetLastError() == ERROR_ACCESS_DENIED; //exists, but belongs to someone else
+	res = WaitForSingleObject(process, 0);
+	CloseHandle(process);
+	return res == WAIT_TIMEOUT;
+}
+
+#else
+
+static uint32_t CurrentProcess()
+{
+	return (uint32_t)getpid();
+}
+
+static bool ProcessAlive(uint32_t pid)
+{
+	return kill((pid_t)pid, 0) == 0 || errno == EPERM;
+}
+
+#endif
+
+SharedRingWriter::SharedRingWriter()
+{
+	header = NULL;
+	mask = 0;
+	index = 0;
+}
+
+SharedRingWriter::~SharedRingWriter()
+{
+	Close();
+}
+
+bool SharedRingWriter::Create(const char * name, uint32_t capacity)
+{
+	uint32_t n = 16;
+	SharedRingHeader * h;
+	uint32_t generation = 1;
+
+	Close();
+
+	while (n < capacity && n < SHARED_RING_MAX_CAPACITY) n *= 2;
+	if (!memory.Create(name, sizeof(SharedRingHeader) + (size_t)n * sizeof(SharedSlot))) return false;
+	h = (SharedRingHeader *)memory.data;
+
+	// An existing ring is only taken over from a writer that closed it or died; a ring that is not ours,
+	// or a section too small for the requested capacity, is left alone as well.
+
+	if (memory.existed)
+	{
+		int error = 0;
+
+		if (memory.size < sizeof(SharedRingHeader) + (size_t)n * sizeof(SharedSlot)) error = SHARED_RING_IN_USE;
+		else if (h->magic.load() == SHARED_RING_MAGIC)
+		{
+			if (h->state.load() == SHARED_RING_ACTIVE && ProcessAlive(h->WriterPid)) error = SHARED_RING_IN_USE;
+			else generation = h->generation.load() + 1; //readers still attached see the change and start over
+		}
+		else if (h->magic.load() != 0) error = SHARED_RING_INVALID;
+
+		if (error != 0)
+		{
+			memory.Detach();
+			memory.error = error;
+			return false;
+		}
+	}
+
+	h->magic.store(0);
+	h->version = SHARED_RING_VERSION;
+	h->capacity = n;
+	h->SlotSize = sizeof(SharedSlot);
+	h->WriterPid = CurrentProcess();
+	h->state.store(SHARED_RING_ACTIVE);
+	h->head.store(0);
+	h->AggregatesSeq.store(0);
+	memset(&h->aggregates, 0, sizeof(h->aggregates));
+	memset((void *)SlotsOf(h), 0, (size_t)n * sizeof(SharedSlot));
+	h->generation.store(generation);
+	h->magic.store(SHARED_RING_MAGIC, std::memory_order_release);
+
+	header = h;
+	mask = n - 1;
+	index = 0;
+	return true;
+}
+
+void SharedRingWriter::Close()
+{
+	if (header != NULL) ((SharedRingHeader *)header)->state.store(SHARED_RING_CLOSED, std::memory_order_release);
+	memory.Close();
+	header = NULL;
+}
+
+void SharedRingWriter::Publish(const NetRecord & rec)
+{
+	SharedRingHeader * h = (SharedRingHeader *)header;
+	uint32_t tag = (uint32_t)(index * 2);
+	uint64_t second = rec.timestamp / 10000000;
+	uint64_t bytes = (uint64_t)rec.size * rec.weight;
+	uint32_t seq;
+
+	if (h == NULL) return;
+
+	SharedSlot & slot = SlotsOf(header)[index & mask];
+	SharedBucket & b = h->aggregates.seconds[second % SHARED_RING_SECONDS];
+
+	//the record: readers that see the odd tag or a different tag afterwards discard their copy
+	slot.seq.store(tag + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(&slot.rec, &rec, sizeof(NetRecord));
+	slot.seq.store(tag + 2, std::memory_order_release);
+
+	index++;
+	h->head.store((uint32_t)index, std::memory_order_release);
+
+	//the aggregates, under the same kind of sequence lock
+	seq = h->AggregatesSeq.load(std::memory_order_relaxed);
+	h->AggregatesSeq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	if (b.second != second)
+	{
+		b.second = second;
+		b.events = 0;
+		b.SentBytes = 0;
+		b.RecvBytes = 0;
+	}
+	h->aggregates.events += rec.weight;
+	b.events += rec.weight;
+	if (NetOpcodeIsSend(rec.opcode)) { h->aggregates.SentBytes += bytes; b.SentBytes += bytes; }
+	else if (NetOpcodeIsRecv(rec.opcode)) { h->aggregates.RecvBytes += bytes; b.RecvBytes += bytes; }
+
+	h->AggregatesSeq.store(seq + 2, std::memory_order_release);
+}
+
+/* ****** Reader ****** */
+
+SharedRingReader::SharedRingReader()
+{
+	cursor = 0;
+	lost = 0;
+	header = NULL;
+	mask = 0;
+	generation = 0;
+	name[0] = 0;
+}
+
+SharedRingReader::~SharedRingReader()
+{
+	Close();
+}
+
+bool SharedRingReader::Attach()
+{
+	const SharedRingHeader * h;
+
+	header = NULL;
+	if (!memory.Open(name)) return false;
+
+	h = (const SharedRingHeader *)memory.data;
+	if (memory.size < sizeof(SharedRingHeader) || h->magic.load(std::memory_order_acquire) != SHARED_RING_MAGIC ||
+		h->version != SHARED_RING_VERSION || h->SlotSize != sizeof(SharedSlot) ||
+		h->capacity == 0 || (h->capacity & (h->capacity - 1)) != 0 ||
+		memory.size < sizeof(SharedRingHeader) + (size_t)h->capacity * sizeof(SharedSlot))
+	{
+		memory.Close();
+		memory.error = SHARED_RING_INVALID;
+		return false;
+	}
+
+	header = h;
+	mask = h->capacity - 1;
+	generation = h->generation.load(std::memory_order_acquire);
+	return true;
+}
+
+//True if "name" is a ring with an active writer
+static bool LiveRingNamed(const char * name)
+{
+	SharedMemory probe;
+	const SharedRingHeader * h;
+
+	if (!probe.Open(name) || probe.size < sizeof(SharedRingHeader)) return false;
+	h = (const SharedRingHeader *)probe.data;
+	return h->magic.load(std::memory_order_acquire) == SHARED_RING_MAGIC &&
+		h->state.load(std::memory_order_acquire) == SHARED_RING_ACTIVE;
+}
+
+bool SharedRingReader::Open(const char * name)
+{
+	Close();
+
+	strncpy(this->name, name, sizeof(this->name) - 1);
+	this->name[sizeof(this->name) - 1] = 0;
+	if (!Attach()) return false;
+
+	cursor = ((const SharedRingHeader *)header)->head.load(std::memory_order_acquire);
+	lost = 0;
+	return true;
+}
+
+void SharedRingReader::Close()
+{
+	memory.Close();
+	header = NULL;
+}
+
+bool SharedRingReader::WriterActive() const
+{
+	const SharedRingHeader * h = (const SharedRingHeader *)header;
+	return h != NULL && h->state.load(std::memory_order_acquire) == SHARED_RING_ACTIVE &&
+		h->generation.load(std::memory_order_acquire) == generation;
+}
+
+uint32_t SharedRingReader::Read(NetRecord * records, uint32_t max)
+{
+	const SharedRingHeader * h = (const SharedRingHeader *)header;
+	const SharedSlot * slots;
+	uint32_t capacity;
+	uint32_t n = 0;
+	uint32_t head, available;
+
+	if (h == NULL) return 0;
+
+	// A new writer has taken the ring over, possibly with another capacity (and on POSIX systems, with a
+	// larger object): map it again and start from its first record.
+
+	if (h->generation.load(std::memory_order_acquire) != generation)
+	{
+		if (!Attach()) return 0;
+		h = (const SharedRingHeader *)header;
+		cursor = 0;
+	}
+
+	// The writer closed the ring and everything in it was read. On POSIX systems the closed ring is no
+	// longer reachable by its name, and a new writer creates another one: move to it once it exists.
+
+	if (h->state.load(std::memory_order_acquire) != SHARED_RING_ACTIVE &&
+		h->head.load(std::memory_order_acquire) == (uint32_t)cursor && LiveRingNamed(name))
+	{
+		if (!Attach()) return 0;
+		h = (const SharedRingHeader *)header;
+		cursor = 0;
+	}
+
+	slots = SlotsOf(header);
+	capacity = mask + 1;
+	head = h->head.load(std::memory_order_acquire);
+
+	while (n < max)
+	{
+		available = head - (uint32_t)cursor;
+
+		if (available == 0) break;
+
+		if (available > 0x80000000)
+		{
+			//the cursor is ahead of the writer: it restarted and the generation check will follow, resynchronize
+			cursor += available;
+			break;
+		}
+
+		if (available > capacity)
+		{
+			// The writer has lapped this reader. Skip to half a ring behind the writer, so that the
+			// records read next are not overwritten right away.
+
+			lost += available - capacity / 2;
+			cursor += available - capacity / 2;
+			continue;
+		}
+
+		const SharedSlot & slot = slots[cursor & mask];
+		uint32_t expected = (uint32_t)(cursor * 2 + 2);
+
+		if (slot.seq.load(std::memory_order_acquire) == expected)
+		{
+			memcpy(&records[n], &slot.rec, sizeof(NetRecord));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.seq.load(std::memory_order_relaxed) == expected)
+			{
+				n++;
+				cursor++;
+				continue;
+			}
+		}
+
+		// The slot holds something else. If the writer has moved on by a whole ring since, it is overwriting
+		// this record: skip ahead. Otherwise (a restart in progress) the caller retries later.
+
+		head = h->head.load(std::memory_order_acquire);
+		available = head - (uint32_t)cursor;
+		if (available < capacity || available > 0x80000000) break;
+
+		lost += available - capacity / 2;
+		cursor += available - capacity / 2;
+	}
+
+	return n;
+}
+
+bool SharedRingReader::ReadAggregates(SharedAggregates * aggregates) const
+{
+	const SharedRingHeader * h = (const SharedRingHeader *)header;
+
+	if (h == NULL) return false;
+
+	for (int attempt = 0; attempt < 100; attempt++)
+	{
+		uint32_t seq = h->AggregatesSeq.load(std::memory_order_acquire);
+		if ((seq & 1) != 0) continue;
+
+		memcpy(aggregates, &h->aggregates, sizeof(SharedAggregates));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (h->AggregatesSeq.load(std::memory_order_relaxed) == seq) return true;
+	}
+	return false;
+}
+
+} // END NAMESPACE
@@ -0,0 +1,131 @@
+//Publication of network events to other processes through a named shared-memory ring
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "NetRecord.h"
+
+namespace EtwNetwork
+{
+
+#define SHARED_RING_SECONDS 60 //per-second totals kept in the aggregates
+
+struct SharedBucket
+{
+	uint64_t second; //FILETIME / 10^7
+	uint64_t events;
+	uint64_t SentBytes; //weighted
+	uint64_t RecvBytes;
+};
+
+//Rolling totals of everything published, maintained by the writer
+struct SharedAggregates
+{
+	uint64_t events;
+	uint64_t SentBytes; //weighted
+	uint64_t RecvBytes;
+	SharedBucket seconds[SHARED_RING_SECONDS]; //bucket of second s is seconds[s % SHARED_RING_SECONDS]
+};
+
+//Named shared memory block: a file mapping on Windows, a POSIX shared memory object elsewhere.
+//The creator can write it; any authenticated user (on POSIX systems, any user) can map it read-only.
+class SharedMemory
+{
+public:
+	uint8_t * data;
+	size_t size;
+	int error; //system error code of the last failed call
+	bool existed; //Create found the name in use and opened that memory; it is never shrunk, so size may be larger
+
+	SharedMemory();
+	~SharedMemory();
+
+	bool Create(const char * name, size_t size); //read-write, created if it does not exist
+	bool Open(const char * name); //read-only, must exist
+	void Close(); //the creator also removes the name (POSIX); a later Create makes a new object under it
+	void Detach(); //closes without removing the name
+
+private:
+	void * handle;
+	int fd;
+	char name[256];
+	bool owner;
+
+	SharedMemory(const SharedMemory &);
+	SharedMemory & operator=(const SharedMemory &);
+};
+
+// Writer side of the ring. Records are published into slots guarded by sequence numbers, so the writer
+// never waits for readers and readers need no write access: a reader that falls more than the capacity
+// behind loses the overwritten records and detects that. Single writer; not thread-safe.
+// Create fails if another live writer holds a ring of that name; a ring left by a closed or dead writer is
+// taken over, and readers still attached to it start over with the new one. On POSIX systems Close removes
+// the name, so the next writer creates another ring: attached readers finish the closed one and then move to it.
+
+class SharedRingWriter
+{
+public:
+	SharedRingWriter();
+	~SharedRingWriter();
+
+	bool Create(const char * name, uint32_t capacity); //capacity is rounded up to a power of 2
+	void Close();
+	bool IsOpen() const { return header != NULL; }
+
+	void Publish(const NetRecord & rec);
+
+	uint64_t Published() const { return index; }
+	uint32_t Capacity() const { return mask + 1; }
+	int Error() const { return memory.error; }
+
+private:
+	SharedMemory memory;
+	void * header;
+	uint32_t mask;
+	uint64_t index; //records published so far
+
+	SharedRingWriter(const SharedRingWriter &);
+	SharedRingWriter & operator=(const SharedRingWriter &);
+};
+
+// Reader side of the ring. Each reader keeps its own cursor in its own process, so any number of
+// readers can attach to the same ring with a read-only mapping. Not thread-safe.
+
+class SharedRingReader
+{
+public:
+	uint64_t cursor; //next record to read
+	uint64_t lost; //records overwritten before this reader got to them
+
+	SharedRingReader();
+	~SharedRingReader();
+
+	bool Open(const char * name); //starts at the newest record
+	void Close();
+	bool IsOpen() const { return header != NULL; }
+
+	// Copies up to max records and returns their number; 0 when there is nothing new yet. When a new writer
+	// has taken the ring over, or has created a new ring under the name after the old one was closed and
+	// read to the end, the reader maps it and starts from its first record.
+	uint32_t Read(NetRecord * records, uint32_t max);
+	bool ReadAggregates(SharedAggregates * aggregates) const; //consistent snapshot, false if the writer kept changing it
+
+	bool WriterActive() const;
+	uint32_t Capacity() const { return mask + 1; }
+	int Error() const { return memory.error; }
+
+private:
+	SharedMemory memory;
+	const void * header;
+	uint32_t mask;
+	uint32_t generation; //of the ring the cursor belongs to; changes when the writer starts over
+	char name[256];
+
+	bool Attach(); //maps the ring "name" and checks its header
+
+	SharedRingReader(const SharedRingReader &);
+	SharedRingReader & operator=(const SharedRingReader &);
+};
+
+} // END NAMESPACE
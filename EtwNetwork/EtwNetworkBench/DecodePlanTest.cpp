@@ -0,0 +1,610 @@
+// Tests of the decoding plans (DecodePlan.cpp) on Linux: plans are compiled from TRACE_EVENT_INFO blobs of the
+// TcpIp/UdpIp send and receive schemas and of schemas with structures, length and count references, strings,
+// GUIDs and arrays, read with ReadEventInfo as GetDecodePlan does, and the formatted values are compared with
+// what TdhFormatProperty prints for the same events.
+// Build and run:
+//   g++ -std=c++11 -O2 -I../EtwNetwork DecodePlanTest.cpp ../EtwNetwork/DecodePlan.cpp -o DecodePlanTest
+//   ./DecodePlanTest
+// A schema and an event saved on Windows (TRACE_EVENT_INFO from TdhGetEventInformation and the UserData of the
+// event, as raw files) can be decoded with the same code for comparison with TDH:
+//   ./DecodePlanTest INFO_FILE USERDATA_FILE [POINTER_SIZE]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "NetRecord.h"
+#include "DecodePlan.h"
+
+using namespace EtwNetwork;
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; return; } } while (0)
+
+/* Fixtures */
+
+// Property of a fixture schema. As in EVENT_PROPERTY_INFO, a structure has its first member and number of members
+// in place of the types, and count and length hold property indexes with PLAN_PROPERTY_PARAM_COUNT/LENGTH.
+// A count of 0 without PLAN_PROPERTY_PARAM_COUNT stands for 1, so that scalars need not spell it out.
+struct FixtureProperty
+{
+	const char * name;
+	uint16_t InType; //or StructStartIndex
+	uint16_t OutType; //or NumOfStructMembers
+	uint16_t length;
+	uint16_t count;
+	uint32_t flags;
+};
+
+//Serializes the schema the way TdhGetEventInformation lays out TRACE_EVENT_INFO: header, EVENT_PROPERTY_INFO
+//array, then the property names as null-terminated UTF-16 strings referenced by NameOffset
+static std::vector<uint8_t> MakeEventInfo(uint8_t opcode, uint8_t version, const FixtureProperty * properties, uint32_t count,
+	uint32_t TopLevelCount)
+{
+	std::vector<uint8_t> info(112 + count * 24, 0);
+
+	info[32 + 2] = version; //EventDescriptor
+	info[32 + 5] = opcode;
+	memcpy(&info[100], &count, 4); //PropertyCount
+	memcpy(&info[104], &TopLevelCount, 4); //TopLevelPropertyCount
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint8_t * p = &info[112 + i * 24];
+		uint32_t NameOffset = (uint32_t)info.size();
+		uint16_t n = properties[i].count;
+
+		if (n == 0 && (properties[i].flags & PLAN_PROPERTY_PARAM_COUNT) == 0) n = 1;
+		memcpy(p + 0, &properties[i].flags, 4);
+		memcpy(p + 4, &NameOffset, 4);
+		memcpy(p + 8, &properties[i].InType, 2);
+		memcpy(p + 10, &properties[i].OutType, 2);
+		memcpy(p + 16, &n, 2);
+		memcpy(p + 18, &properties[i].length, 2);
+
+		for (const char * c = properties[i].name; ; c++)
+		{
+			info.push_back((uint8_t)*c);
+			info.push_back(0);
+			if (*c == 0) break;
+		}
+		p = NULL; //"info" may have moved
+	}
+	return info;
+}
+
+static std::string PropertyName(const std::vector<uint8_t> & info, uint16_t property)
+{
+	uint32_t NameOffset;
+	std::string name;
+
+	memcpy(&NameOffset, &info[112 + property * 24 + 4], 4);
+	for (size_t i = NameOffset; i + 1 < info.size() && (info[i] | info[i + 1]) != 0; i += 2) name += (char)info[i];
+	return name;
+}
+
+// Values as "name=value" lines, the way AddPlanProperties builds the event. Values the plan leaves to
+// TdhFormatProperty are shown as their raw bytes in brackets.
+static std::string Format(const std::vector<uint8_t> & info, const DecodeOutput & out)
+{
+	std::string s;
+	char buf[8];
+
+	for (size_t i = 0; i < out.values.size(); i++)
+	{
+		const PlanValue & v = out.values[i];
+
+		s += PropertyName(info, v.property) + "=";
+		if (v.text == PLAN_NO_TEXT)
+		{
+			s += "[";
+			for (uint32_t k = 0; k < v.size; k++)
+			{
+				snprintf(buf, sizeof(buf), "%02x", v.data[k]);
+				s += buf;
+			}
+			s += "]";
+		}
+		else for (uint32_t k = 0; k < v.TextLength; k++) s += (char)out.text[v.text + k];
+		s += "\n";
+	}
+	return s;
+}
+
+static void Put(std::vector<uint8_t> & data, uint64_t v, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) data.push_back((uint8_t)(v >> (i * 8)));
+}
+
+static void PutBytes(std::vector<uint8_t> & data, const uint8_t * p, uint32_t size)
+{
+	data.insert(data.end(), p, p + size);
+}
+
+// Schemas of the kernel TcpIp and UdpIp classes (TcpIp_SendIPV4, TcpIp_TypeGroup1, TcpIp_SendIPV6,
+// TcpIp_TypeGroup3, UdpIp_TypeGroup1, UdpIp_TypeGroup2) with the types TDH reports for them
+
+static const FixtureProperty TcpSend4[] = {
+	{ "PID", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "size", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "daddr", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_IPV4, 4, 0, 0 },
+	{ "saddr", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_IPV4, 4, 0, 0 },
+	{ "dport", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2, 0, 0 },
+	{ "sport", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2, 0, 0 },
+	{ "startime", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "endtime", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "seqnum", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "connid", PLAN_INTYPE_POINTER, PLAN_OUTTYPE_NULL, 0, 0, 0 },
+};
+
+static const FixtureProperty TcpRecv4[] = {
+	{ "PID", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "size", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "daddr", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_IPV4, 4, 0, 0 },
+	{ "saddr", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_IPV4, 4, 0, 0 },
+	{ "dport", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2, 0, 0 },
+	{ "sport", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2, 0, 0 },
+	{ "seqnum", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "connid", PLAN_INTYPE_POINTER, PLAN_OUTTYPE_NULL, 0, 0, 0 },
+};
+
+static const FixtureProperty TcpSend6[] = {
+	{ "PID", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "size", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "daddr", PLAN_INTYPE_BINARY, PLAN_OUTTYPE_IPV6, 16, 0, 0 },
+	{ "saddr", PLAN_INTYPE_BINARY, PLAN_OUTTYPE_IPV6, 16, 0, 0 },
+	{ "dport", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2, 0, 0 },
+	{ "sport", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2, 0, 0 },
+	{ "startime", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "endtime", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "seqnum", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "connid", PLAN_INTYPE_POINTER, PLAN_OUTTYPE_NULL, 0, 0, 0 },
+};
+
+static const FixtureProperty UdpData6[] = {
+	{ "PID", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "size", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "daddr", PLAN_INTYPE_BINARY, PLAN_OUTTYPE_IPV6, 16, 0, 0 },
+	{ "saddr", PLAN_INTYPE_BINARY, PLAN_OUTTYPE_IPV6, 16, 0, 0 },
+	{ "dport", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2, 0, 0 },
+	{ "sport", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2, 0, 0 },
+	{ "seqnum", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+	{ "connid", PLAN_INTYPE_POINTER, PLAN_OUTTYPE_NULL, 0, 0, 0 },
+};
+
+#define COUNT(a) ((uint32_t)(sizeof(a) / sizeof(a[0])))
+
+static const uint8_t Daddr4[4] = { 10, 1, 2, 3 };
+static const uint8_t Saddr4[4] = { 192, 168, 0, 17 };
+static const uint8_t Port443[2] = { 0x01, 0xBB }; //network byte order
+static const uint8_t Port49731[2] = { 0xC2, 0x43 };
+static const uint8_t Daddr6[16] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01 };
+static const uint8_t Saddr6[16] = { 0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0x02, 0x15, 0x5d, 0xff, 0xfe, 0x01, 0x02, 0x03 };
+
+//UserData of a send/receive event with the fields of the fixture schemas
+static std::vector<uint8_t> MakeUserData(bool ip6, bool times, uint32_t PointerSize, uint64_t connid)
+{
+	std::vector<uint8_t> data;
+
+	Put(data, 4312, 4); //PID
+	Put(data, 1460, 4); //size
+	if (ip6) { PutBytes(data, Daddr6, 16); PutBytes(data, Saddr6, 16); }
+	else { PutBytes(data, Daddr4, 4); PutBytes(data, Saddr4, 4); }
+	PutBytes(data, Port443, 2);
+	PutBytes(data, Port49731, 2);
+	if (times) { Put(data, 2710463, 4); Put(data, 2710464, 4); }
+	Put(data, 0, 4); //seqnum
+	Put(data, connid, PointerSize);
+	return data;
+}
+
+/* Tests */
+
+//Compiles the fixture through ReadEventInfo and compares the decoded event with TDH
+static void CheckFixture(const FixtureProperty * schema, uint32_t count, uint8_t proto, uint8_t opcode,
+	uint32_t PointerSize, uint64_t connid, const char * expected)
+{
+	bool ip6 = NetOpcodeIsIp6(opcode);
+	bool times = proto == NET_PROTO_TCP && NetOpcodeIsSend(opcode);
+	std::vector<uint8_t> info = MakeEventInfo(opcode, 2, schema, count, count);
+	std::vector<uint8_t> data = MakeUserData(ip6, times, PointerSize, connid);
+	std::vector<PlanProperty> properties;
+	uint32_t TopLevelCount = 0;
+	DecodePlan plan;
+	DecodeOutput out;
+	NetRecord rec;
+	NetConnection conn;
+
+	CHECK(ReadEventInfo(&info[0], info.size(), properties, &TopLevelCount));
+	CHECK(properties.size() == count && TopLevelCount == count);
+	CHECK(plan.Compile(&properties[0], count, TopLevelCount, PointerSize));
+	CHECK(plan.Execute(&data[0], (uint32_t)data.size(), out));
+	CHECK(out.values.size() == count);
+	if (Format(info, out) != expected) fprintf(stderr, "%s", Format(info, out).c_str());
+	CHECK(Format(info, out) == expected);
+
+	//the plan agrees with the fixed layout decoders
+	CHECK(DecodeNetRecord(proto, opcode, &data[0], (uint32_t)data.size(), &rec));
+	CHECK(DecodeNetConnection(proto, opcode, &data[0], (uint32_t)data.size(), PointerSize, &conn));
+	CHECK(rec.pid == 4312 && rec.size == 1460 && rec.dport == 443 && rec.sport == 49731);
+	CHECK(memcmp(rec.daddr, out.values[2].data, ip6 ? 16 : 4) == 0);
+	CHECK(conn.connid == connid && conn.seqnum == 0);
+	CHECK(out.values[count - 1].data == &data[data.size() - PointerSize]);
+}
+
+// Compiles the schema through ReadEventInfo, decodes "data" with the plan and compares the values with TDH.
+// The values must cover the whole of UserData, so that every offset is checked.
+static void CheckSchema(const FixtureProperty * schema, uint32_t count, uint32_t TopLevelCount, uint32_t PointerSize,
+	const std::vector<uint8_t> & data, const char * expected)
+{
+	std::vector<uint8_t> info = MakeEventInfo(10, 0, schema, count, TopLevelCount);
+	std::vector<PlanProperty> properties;
+	uint32_t top = 0;
+	DecodePlan plan;
+	DecodeOutput out;
+
+	CHECK(ReadEventInfo(&info[0], info.size(), properties, &top));
+	CHECK(properties.size() == count && top == TopLevelCount);
+	CHECK(plan.Compile(&properties[0], count, TopLevelCount, PointerSize));
+	CHECK(plan.Execute(&data[0], (uint32_t)data.size(), out));
+	if (Format(info, out) != expected) fprintf(stderr, "%s", Format(info, out).c_str());
+	CHECK(Format(info, out) == expected);
+	CHECK(!out.values.empty() && out.values.back().data + out.values.back().size == &data[0] + data.size());
+
+	//and nothing is read past the end of a shorter event
+	out.Clear();
+	CHECK(!plan.Execute(&data[0], (uint32_t)data.size() - 1, out) || Format(info, out) != expected);
+}
+
+static void TestTcpSend4()
+{
+	CheckFixture(TcpSend4, COUNT(TcpSend4), NET_PROTO_TCP, NET_OPCODE_SEND, 8, 0xFFFFFA8004B2C010ULL,
+		"PID=4312\n" "size=1460\n" "daddr=10.1.2.3\n" "saddr=192.168.0.17\n" "dport=443\n" "sport=49731\n"
+		"startime=2710463\n" "endtime=2710464\n" "seqnum=0\n" "connid=0xFFFFFA8004B2C010\n");
+}
+
+static void TestTcpRecv4()
+{
+	CheckFixture(TcpRecv4, COUNT(TcpRecv4), NET_PROTO_TCP, NET_OPCODE_RECV, 8, 0xFFFFFA8004B2C010ULL,
+		"PID=4312\n" "size=1460\n" "daddr=10.1.2.3\n" "saddr=192.168.0.17\n" "dport=443\n" "sport=49731\n"
+		"seqnum=0\n" "connid=0xFFFFFA8004B2C010\n");
+}
+
+//32-bit kernel: connid is 4 bytes
+static void TestTcpRecv4Pointer32()
+{
+	CheckFixture(TcpRecv4, COUNT(TcpRecv4), NET_PROTO_TCP, NET_OPCODE_RECV, 4, 0x85A3C010ULL,
+		"PID=4312\n" "size=1460\n" "daddr=10.1.2.3\n" "saddr=192.168.0.17\n" "dport=443\n" "sport=49731\n"
+		"seqnum=0\n" "connid=0x85A3C010\n");
+}
+
+//IPv6 addresses are formatted by TdhFormatProperty; the plan hands it the 16 bytes
+static void TestTcpSend6()
+{
+	CheckFixture(TcpSend6, COUNT(TcpSend6), NET_PROTO_TCP, NET_OPCODE_SEND_IP6, 8, 0xFFFFFA8004B2C010ULL,
+		"PID=4312\n" "size=1460\n" "daddr=[20010db8000000000000000000000001]\n"
+		"saddr=[fe8000000000000002155dfffe010203]\n" "dport=443\n" "sport=49731\n"
+		"startime=2710463\n" "endtime=2710464\n" "seqnum=0\n" "connid=0xFFFFFA8004B2C010\n");
+}
+
+//UdpIp_TypeGroup1 has the TcpIp_TypeGroup1 layout
+static void TestUdpSend4()
+{
+	CheckFixture(TcpRecv4, COUNT(TcpRecv4), NET_PROTO_UDP, NET_OPCODE_SEND, 8, 0xFFFFFA8004B2C010ULL,
+		"PID=4312\n" "size=1460\n" "daddr=10.1.2.3\n" "saddr=192.168.0.17\n" "dport=443\n" "sport=49731\n"
+		"seqnum=0\n" "connid=0xFFFFFA8004B2C010\n");
+}
+
+static void TestUdpRecv6()
+{
+	CheckFixture(UdpData6, COUNT(UdpData6), NET_PROTO_UDP, NET_OPCODE_RECV_IP6, 4, 0x85A3C010ULL,
+		"PID=4312\n" "size=1460\n" "daddr=[20010db8000000000000000000000001]\n"
+		"saddr=[fe8000000000000002155dfffe010203]\n" "dport=443\n" "sport=49731\n"
+		"seqnum=0\n" "connid=0x85A3C010\n");
+}
+
+//Structure members are decoded in place of the structure, which has no value of its own
+static void TestStruct()
+{
+	static const FixtureProperty schema[] = {
+		{ "PID", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+		{ "Endpoint", 3, 2, 0, 0, PLAN_PROPERTY_STRUCT },
+		{ "Flags", PLAN_INTYPE_HEXINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+		{ "Address", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_IPV4, 4, 0, 0 },
+		{ "Port", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2, 0, 0 },
+	};
+	std::vector<uint8_t> data;
+
+	Put(data, 4312, 4);
+	PutBytes(data, Daddr4, 4);
+	PutBytes(data, Port443, 2);
+	Put(data, 0x10, 4);
+	CheckSchema(schema, COUNT(schema), 3, 8, data,
+		"PID=4312\n" "Address=10.1.2.3\n" "Port=443\n" "Flags=0x10\n");
+}
+
+//Array of structures counted by an earlier property
+static void TestStructArray()
+{
+	static const FixtureProperty schema[] = {
+		{ "Count", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_NULL, 2, 0, 0 },
+		{ "Endpoints", 3, 2, 0, 0, PLAN_PROPERTY_STRUCT | PLAN_PROPERTY_PARAM_COUNT },
+		{ "Tail", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+		{ "Address", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_IPV4, 4, 0, 0 },
+		{ "Port", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2, 0, 0 },
+	};
+	std::vector<uint8_t> data;
+
+	Put(data, 2, 2);
+	PutBytes(data, Daddr4, 4);
+	PutBytes(data, Port443, 2);
+	PutBytes(data, Saddr4, 4);
+	PutBytes(data, Port49731, 2);
+	Put(data, 7, 4);
+	CheckSchema(schema, COUNT(schema), 3, 8, data,
+		"Count=2\n" "Address=10.1.2.3\n" "Port=443\n" "Address=192.168.0.17\n" "Port=49731\n" "Tail=7\n");
+}
+
+//PropertyParamLength and PropertyParamCount: blobs and arrays sized by earlier properties
+static void TestParamLengthCount()
+{
+	static const FixtureProperty schema[] = {
+		{ "Length", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_NULL, 2, 0, 0 },
+		{ "Payload", PLAN_INTYPE_BINARY, PLAN_OUTTYPE_NULL, 0, 0, PLAN_PROPERTY_PARAM_LENGTH },
+		{ "Count", PLAN_INTYPE_UINT8, PLAN_OUTTYPE_NULL, 1, 0, 0 },
+		{ "Values", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 2, PLAN_PROPERTY_PARAM_COUNT },
+		{ "After", PLAN_INTYPE_INT16, PLAN_OUTTYPE_NULL, 2, 0, 0 },
+	};
+	static const uint8_t payload[5] = { 0xde, 0xad, 0xbe, 0xef, 0x01 };
+	std::vector<uint8_t> data;
+
+	Put(data, 5, 2);
+	PutBytes(data, payload, 5);
+	Put(data, 3, 1);
+	Put(data, 1, 4);
+	Put(data, 4000000000U, 4);
+	Put(data, 0, 4);
+	Put(data, (uint16_t)-300, 2);
+	CheckSchema(schema, COUNT(schema), 5, 8, data,
+		"Length=5\n" "Payload=[deadbeef01]\n" "Count=3\n" "Values=1\n" "Values=4000000000\n" "Values=0\n"
+		"After=-300\n");
+}
+
+// Null-terminated strings. Unicode strings are formatted by the plan; ANSI strings go to TdhFormatProperty
+// with their terminator. A string that runs to the end of UserData ends there.
+static void TestStrings()
+{
+	static const FixtureProperty schema[] = {
+		{ "Image", PLAN_INTYPE_UNICODESTRING, PLAN_OUTTYPE_NULL, 0, 0, 0 },
+		{ "Command", PLAN_INTYPE_ANSISTRING, PLAN_OUTTYPE_NULL, 0, 0, 0 },
+		{ "Empty", PLAN_INTYPE_UNICODESTRING, PLAN_OUTTYPE_STRING, 0, 0, 0 },
+		{ "Status", PLAN_INTYPE_INT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+		{ "Tail", PLAN_INTYPE_UNICODESTRING, PLAN_OUTTYPE_NULL, 0, 0, 0 },
+	};
+	std::vector<uint8_t> data;
+
+	for (const char * c = "svchost.exe"; ; c++) { Put(data, (uint8_t)*c, 2); if (*c == 0) break; }
+	PutBytes(data, (const uint8_t *)"-k net", 7);
+	Put(data, 0, 2);
+	Put(data, (uint32_t)-5, 4);
+	for (const char * c = "end"; *c; c++) Put(data, (uint8_t)*c, 2);
+	CheckSchema(schema, COUNT(schema), 5, 8, data,
+		"Image=svchost.exe\n" "Command=[2d6b206e657400]\n" "Empty=\n" "Status=-5\n" "Tail=end\n");
+}
+
+//GUIDs in registry format, with the first three groups little-endian in UserData
+static void TestGuid()
+{
+	static const FixtureProperty schema[] = {
+		{ "Provider", PLAN_INTYPE_GUID, PLAN_OUTTYPE_NULL, 16, 0, 0 },
+		{ "Activity", PLAN_INTYPE_GUID, PLAN_OUTTYPE_GUID, 16, 0, 0 },
+	};
+	//{9A280AC0-C8E0-11D1-84E2-00C04FB998A2}, the TcpIp class
+	static const uint8_t TcpIp[16] = { 0xc0, 0x0a, 0x28, 0x9a, 0xe0, 0xc8, 0xd1, 0x11, 0x84, 0xe2, 0x00, 0xc0, 0x4f, 0xb9, 0x98, 0xa2 };
+	std::vector<uint8_t> data;
+
+	PutBytes(data, TcpIp, 16);
+	Put(data, 0, 16);
+	CheckSchema(schema, COUNT(schema), 2, 8, data,
+		"Provider={9A280AC0-C8E0-11D1-84E2-00C04FB998A2}\n" "Activity={00000000-0000-0000-0000-000000000000}\n");
+}
+
+//Arrays with a count in the schema keep the following properties at fixed offsets
+static void TestFixedArray()
+{
+	static const FixtureProperty schema[] = {
+		{ "Ports", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2, 3, 0 },
+		{ "Address", PLAN_INTYPE_BINARY, PLAN_OUTTYPE_IPV6, 16, 0, 0 },
+		{ "After", PLAN_INTYPE_UINT64, PLAN_OUTTYPE_NULL, 8, 0, 0 },
+	};
+	std::vector<uint8_t> data;
+
+	PutBytes(data, Port443, 2);
+	PutBytes(data, Port49731, 2);
+	Put(data, 0x5000, 2); //80
+	PutBytes(data, Daddr6, 16);
+	Put(data, 18446744073709551615ULL, 8);
+	CheckSchema(schema, COUNT(schema), 3, 8, data,
+		"Ports=443\n" "Ports=49731\n" "Ports=80\n" "Address=[20010db8000000000000000000000001]\n"
+		"After=18446744073709551615\n");
+}
+
+//Arrays counted by a property that is 0 have no values and take no UserData
+static void TestZeroCount()
+{
+	static const FixtureProperty schema[] = {
+		{ "Count", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+		{ "Values", PLAN_INTYPE_UINT64, PLAN_OUTTYPE_NULL, 8, 0, PLAN_PROPERTY_PARAM_COUNT },
+		{ "Endpoints", 4, 2, 0, 0, PLAN_PROPERTY_STRUCT | PLAN_PROPERTY_PARAM_COUNT },
+		{ "After", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+		{ "Address", PLAN_INTYPE_UINT32, PLAN_OUTTYPE_IPV4, 4, 0, 0 },
+		{ "Port", PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2, 0, 0 },
+	};
+	std::vector<uint8_t> data;
+
+	Put(data, 0, 4);
+	Put(data, 9, 4);
+	CheckSchema(schema, COUNT(schema), 4, 8, data, "Count=0\n" "After=9\n");
+}
+
+// Pointers and hex integers: "0x" and uppercase digits without leading zeros, the format expected of
+// TdhFormatProperty. Not compared with its output yet; a saved event can be checked with the file mode above.
+static void TestPointerHex()
+{
+	static const FixtureProperty schema[] = {
+		{ "Null", PLAN_INTYPE_POINTER, PLAN_OUTTYPE_NULL, 0, 0, 0 },
+		{ "Small", PLAN_INTYPE_POINTER, PLAN_OUTTYPE_NULL, 0, 0, 0 },
+		{ "Kernel", PLAN_INTYPE_POINTER, PLAN_OUTTYPE_NULL, 0, 0, 0 },
+		{ "Flags", PLAN_INTYPE_HEXINT32, PLAN_OUTTYPE_NULL, 4, 0, 0 },
+		{ "Mask", PLAN_INTYPE_UINT64, PLAN_OUTTYPE_HEXINT64, 8, 0, 0 },
+		{ "Byte", PLAN_INTYPE_UINT8, PLAN_OUTTYPE_HEXINT8, 1, 0, 0 },
+	};
+	std::vector<uint8_t> data;
+
+	Put(data, 0, 8);
+	Put(data, 0x1000, 8);
+	Put(data, 0xFFFFFA8004B2C010ULL, 8);
+	Put(data, 0xA, 4);
+	Put(data, 0xDEADBEEFULL, 8);
+	Put(data, 0x0F, 1);
+	CheckSchema(schema, COUNT(schema), 6, 8, data,
+		"Null=0x0\n" "Small=0x1000\n" "Kernel=0xFFFFFA8004B2C010\n" "Flags=0xA\n" "Mask=0xDEADBEEF\n" "Byte=0xF\n");
+
+	data.clear();
+	Put(data, 0, 4);
+	Put(data, 0x1000, 4);
+	Put(data, 0x85A3C010, 4);
+	Put(data, 0, 4);
+	Put(data, 0, 8);
+	Put(data, 0xFF, 1);
+	CheckSchema(schema, COUNT(schema), 6, 4, data,
+		"Null=0x0\n" "Small=0x1000\n" "Kernel=0x85A3C010\n" "Flags=0x0\n" "Mask=0x0\n" "Byte=0xFF\n");
+}
+
+//Damaged blobs are rejected instead of read past their end
+static void TestBadEventInfo()
+{
+	std::vector<uint8_t> info = MakeEventInfo(NET_OPCODE_RECV, 2, TcpRecv4, COUNT(TcpRecv4), COUNT(TcpRecv4));
+	std::vector<PlanProperty> properties;
+	uint32_t TopLevelCount = 0, flags, big = 100;
+	uint16_t index = 50;
+
+	CHECK(!ReadEventInfo(&info[0], 100, properties, &TopLevelCount));
+	CHECK(!ReadEventInfo(&info[0], 112 + 7 * 24, properties, &TopLevelCount));
+	CHECK(properties.empty());
+
+	std::vector<uint8_t> bad = info;
+	memcpy(&bad[104], &big, 4); //more top-level properties than properties
+	CHECK(!ReadEventInfo(&bad[0], bad.size(), properties, &TopLevelCount));
+
+	bad = info;
+	flags = PLAN_PROPERTY_PARAM_LENGTH;
+	memcpy(&bad[112 + 24 + 0], &flags, 4);
+	memcpy(&bad[112 + 24 + 18], &index, 2); //length taken from a property that doesn't exist
+	CHECK(!ReadEventInfo(&bad[0], bad.size(), properties, &TopLevelCount));
+
+	bad = info;
+	flags = PLAN_PROPERTY_STRUCT;
+	memcpy(&bad[112 + 0], &flags, 4);
+	memcpy(&bad[112 + 8], &index, 2); //members past the end of the table
+	CHECK(!ReadEventInfo(&bad[0], bad.size(), properties, &TopLevelCount));
+
+	//a truncated event does not match the plan
+	std::vector<uint8_t> data = MakeUserData(false, false, 8, 1);
+	DecodePlan plan;
+	DecodeOutput out;
+	CHECK(ReadEventInfo(&info[0], info.size(), properties, &TopLevelCount));
+	CHECK(plan.Compile(&properties[0], (uint32_t)properties.size(), TopLevelCount, 8));
+	CHECK(!plan.Execute(&data[0], (uint32_t)data.size() - 1, out));
+	CHECK(out.values.empty() && out.text.empty());
+}
+
+/* Harness */
+
+static bool LoadFile(const char * path, std::vector<uint8_t> & data)
+{
+	FILE * f = fopen(path, "rb");
+	uint8_t buf[4096];
+	size_t n;
+
+	if (f == NULL) return false;
+	data.clear();
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + n);
+	fclose(f);
+	return true;
+}
+
+//Decodes a saved event with the plan compiled from its saved schema
+static int DecodeFiles(const char * InfoPath, const char * DataPath, uint32_t PointerSize)
+{
+	std::vector<uint8_t> info, data;
+	std::vector<PlanProperty> properties;
+	uint32_t TopLevelCount = 0;
+	DecodePlan plan;
+	DecodeOutput out;
+
+	if (!LoadFile(InfoPath, info) || !LoadFile(DataPath, data))
+	{
+		fprintf(stderr, "can't read %s or %s\n", InfoPath, DataPath);
+		return 1;
+	}
+	if (!ReadEventInfo(info.empty() ? NULL : &info[0], info.size(), properties, &TopLevelCount))
+	{
+		fprintf(stderr, "%s is not a valid TRACE_EVENT_INFO\n", InfoPath);
+		return 1;
+	}
+	if (!plan.Compile(properties.empty() ? NULL : &properties[0], (uint32_t)properties.size(), TopLevelCount, PointerSize))
+	{
+		fprintf(stderr, "the schema can't be decoded with a plan\n");
+		return 1;
+	}
+	if (!plan.Execute(data.empty() ? NULL : &data[0], (uint32_t)data.size(), out))
+	{
+		fprintf(stderr, "the event doesn't match the schema\n");
+		return 1;
+	}
+	printf("%s", Format(info, out).c_str());
+	return 0;
+}
+
+struct Test
+{
+	const char * name;
+	void (*run)();
+};
+
+static const Test Tests[] = {
+	{ "tcp-send-ipv4", TestTcpSend4 },
+	{ "tcp-recv-ipv4", TestTcpRecv4 },
+	{ "tcp-recv-ipv4-pointer32", TestTcpRecv4Pointer32 },
+	{ "tcp-send-ipv6", TestTcpSend6 },
+	{ "udp-send-ipv4", TestUdpSend4 },
+	{ "udp-recv-ipv6", TestUdpRecv6 },
+	{ "struct", TestStruct },
+	{ "struct-array", TestStructArray },
+	{ "param-length-count", TestParamLengthCount },
+	{ "strings", TestStrings },
+	{ "guid", TestGuid },
+	{ "fixed-array", TestFixedArray },
+	{ "zero-count", TestZeroCount },
+	{ "pointer-hex", TestPointerHex },
+	{ "bad-event-info", TestBadEventInfo },
+};
+
+int main(int argc, char ** argv)
+{
+	if (argc == 3 || argc == 4) return DecodeFiles(argv[1], argv[2], argc == 4 ? (uint32_t)atoi(argv[3]) : 8);
+
+	for (size_t i = 0; i < sizeof(Tests) / sizeof(Tests[0]); i++)
+	{
+		int before = failures;
+
+		Tests[i].run();
+		printf("%s %s\n", failures == before ? "PASS" : "FAIL", Tests[i].name);
+	}
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,830 @@
+// EtwNetworkBench.cpp: microbenchmarks and end-to-end harness for the native capture and decode path.
+// Runs on a synthetic workload, so no ETW session (and no administrator rights) is needed.
+// Results are written as CSV and can be compared against a stored baseline:
+//   EtwNetworkBench --out base.csv
+//   EtwNetworkBench --baseline base.csv --tolerance 10
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "NetRecord.h"
+#include "Sampling.h"
+#include "HistoryStore.h"
+#include "AnomalyDetector.h"
+#include "DecodePlan.h"
+#include "Coalescer.h"
+#include "SharedRing.h"
+#include "NetBatch.h"
+#include "Workload.h"
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define snprintf _snprintf
+#define strtoull _strtoui64
+#endif
+
+using namespace EtwNetwork;
+using namespace EtwNetworkBench;
+
+/* Infrastructure */
+
+static uint64_t NowNs()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq = {0};
+	LARGE_INTEGER t;
+	if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t);
+	return (uint64_t)((double)t.QuadPart * 1000000000.0 / (double)freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+struct BenchContext
+{
+	Workload workload;
+	std::vector<NetRecord> records; //workload decoded in advance, input of the stages after decoding
+	std::vector<NetRecord> LocalAddresses; //addresses of "local interfaces" for filtering
+	double BytesPerEvent; //memory used per stored event, set by the benchmarks that store events
+};
+
+typedef uint64_t (*BenchFunction)(BenchContext & ctx); //returns a checksum, so the work can't be optimized away
+
+struct Benchmark
+{
+	const char * name;
+	BenchFunction run;
+};
+
+struct BenchResult
+{
+	std::string name;
+	uint64_t events;
+	double NsPerEvent;
+	double EventsPerSec;
+	double BytesPerEvent; //0 if the benchmark doesn't store events
+};
+
+// Single producer, single consumer ring of records, the handoff between the ETW thread and consumers
+
+class RecordRing
+{
+public:
+	RecordRing(uint32_t capacity) : slots(capacity), mask(capacity - 1), head(0), tail(0) {}
+
+	bool TryPush(const NetRecord & rec)
+	{
+		uint32_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) > mask) return false;
+		slots[h & mask] = rec;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool TryPop(NetRecord & rec)
+	{
+		uint32_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire)) return false;
+		rec = slots[t & mask];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::vector<NetRecord> slots;
+	uint32_t mask;
+	std::atomic<uint32_t> head;
+	char padding[64];
+	std::atomic<uint32_t> tail;
+};
+
+struct FlowTotals
+{
+	uint64_t SentBytes;
+	uint64_t RecvBytes;
+	uint64_t events;
+};
+
+static void Aggregate(std::unordered_map<uint32_t, FlowTotals> & table, const NetRecord & rec)
+{
+	FlowTotals & t = table[NetRecordFlowHash(&rec)];
+	if (NetOpcodeIsSend(rec.opcode)) t.SentBytes += (uint64_t)rec.size * rec.weight;
+	else if (NetOpcodeIsRecv(rec.opcode)) t.RecvBytes += (uint64_t)rec.size * rec.weight;
+	t.events += rec.weight;
+}
+
+/* Microbenchmarks */
+
+static uint64_t BenchDecode(BenchContext & ctx)
+{
+	const Workload & w = ctx.workload;
+	NetRecord rec;
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < w.events.size(); i++)
+	{
+		const SyntheticEvent & e = w.events[i];
+		if (DecodeNetRecord(e.proto, e.opcode, &w.data[e.offset], e.length, &rec)) sum += rec.size + rec.dport;
+	}
+	return sum;
+}
+
+static bool IsLocal(const BenchContext & ctx, const uint8_t * addr, bool ip6)
+{
+	for (size_t j = 0; j < ctx.LocalAddresses.size(); j++)
+	{
+		if ((ctx.LocalAddresses[j].ip6 != 0) != ip6) continue;
+		if (memcmp(ctx.LocalAddresses[j].saddr, addr, ip6 ? 16 : 4) == 0) return true;
+	}
+	return false;
+}
+
+static PlanProperty MakeProperty(uint16_t InType, uint16_t OutType, uint16_t length)
+{
+	PlanProperty p;
+	memset(&p, 0, sizeof(p));
+	p.InType = InType;
+	p.OutType = OutType;
+	p.length = length;
+	p.count = 1;
+	return p;
+}
+
+//Generic decoding with plans compiled from the TcpIp send/receive schemas, values formatted to text
+static uint64_t BenchDecodePlan(BenchContext & ctx)
+{
+	const Workload & w = ctx.workload;
+	PlanProperty v4[6], v6[6];
+	DecodePlan plan4, plan6;
+	DecodeOutput out;
+	uint64_t sum = 0;
+
+	v4[0] = MakeProperty(PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4); //PID
+	v4[1] = MakeProperty(PLAN_INTYPE_UINT32, PLAN_OUTTYPE_NULL, 4); //size
+	v4[2] = MakeProperty(PLAN_INTYPE_UINT32, PLAN_OUTTYPE_IPV4, 4); //daddr
+	v4[3] = MakeProperty(PLAN_INTYPE_UINT32, PLAN_OUTTYPE_IPV4, 4); //saddr
+	v4[4] = MakeProperty(PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2); //dport
+	v4[5] = MakeProperty(PLAN_INTYPE_UINT16, PLAN_OUTTYPE_PORT, 2); //sport
+	for (int i = 0; i < 6; i++) v6[i] = v4[i];
+	v6[2] = MakeProperty(PLAN_INTYPE_BINARY, PLAN_OUTTYPE_IPV6, 0);
+	v6[3] = MakeProperty(PLAN_INTYPE_BINARY, PLAN_OUTTYPE_IPV6, 0);
+	plan4.Compile(v4, 6, 6, 8);
+	plan6.Compile(v6, 6, 6, 8);
+
+	for (size_t i = 0; i < w.events.size(); i++)
+	{
+		const SyntheticEvent & e = w.events[i];
+		const DecodePlan & plan = NetOpcodeIsIp6(e.opcode) ? plan6 : plan4;
+
+		out.Clear();
+		if (plan.Execute(&w.data[e.offset], e.length, out)) sum += out.values.size() + out.text.size();
+	}
+	return sum;
+}
+
+static uint64_t BenchFilter(BenchContext & ctx)
+{
+	uint64_t matched = 0;
+
+	for (size_t i = 0; i < ctx.records.size(); i++)
+	{
+		const NetRecord & rec = ctx.records[i];
+		if (IsLocal(ctx, rec.saddr, rec.ip6 != 0) || IsLocal(ctx, rec.daddr, rec.ip6 != 0)) matched++;
+	}
+	return matched;
+}
+
+static uint64_t BenchAggregate(BenchContext & ctx)
+{
+	std::unordered_map<uint32_t, FlowTotals> table;
+
+	for (size_t i = 0; i < ctx.records.size(); i++) Aggregate(table, ctx.records[i]);
+	return table.size();
+}
+
+static uint64_t BenchSample(BenchContext & ctx)
+{
+	AdaptiveSampler sampler;
+	uint64_t kept = 0;
+
+	sampler.mode = SamplingPerFlow;
+	sampler.period = 8;
+	for (size_t i = 0; i < ctx.records.size(); i++)
+	{
+		if (sampler.SampleFlow(NetRecordFlowHash(&ctx.records[i])) != 0) kept++;
+	}
+	return kept;
+}
+
+static uint64_t BenchRing(BenchContext & ctx)
+{
+	RecordRing ring(4096);
+	uint64_t sum = 0;
+	size_t n = ctx.records.size();
+
+	std::thread consumer([&ring, &sum, n]() {
+		NetRecord rec;
+		for (size_t i = 0; i < n; )
+		{
+			if (ring.TryPop(rec)) { sum += rec.size; i++; }
+			else std::this_thread::yield();
+		}
+	});
+
+	for (size_t i = 0; i < n; )
+	{
+		if (ring.TryPush(ctx.records[i])) i++;
+		else std::this_thread::yield();
+	}
+	consumer.join();
+	return sum;
+}
+
+static uint64_t BenchExport(BenchContext & ctx)
+{
+	std::vector<char> buf(1 << 16);
+	size_t used = 0;
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < ctx.records.size(); i++)
+	{
+		const NetRecord & rec = ctx.records[i];
+		int len;
+
+		if (buf.size() - used < 128) { total += used; used = 0; } //"flush"
+		len = snprintf(&buf[used], buf.size() - used, "%llu,%u,%u,%u,%u.%u.%u.%u,%u,%u.%u.%u.%u,%u\n",
+			(unsigned long long)rec.timestamp, rec.pid, rec.opcode, rec.size,
+			rec.saddr[0], rec.saddr[1], rec.saddr[2], rec.saddr[3], rec.sport,
+			rec.daddr[0], rec.daddr[1], rec.daddr[2], rec.daddr[3], rec.dport);
+		if (len > 0) used += len;
+	}
+	return total + used;
+}
+
+static uint64_t BenchHistoryAppend(BenchContext & ctx)
+{
+	HistoryStore store((size_t)1 << 40);
+
+	for (size_t i = 0; i < ctx.records.size(); i++) store.Append(ctx.records[i]);
+	store.Seal();
+	if (store.EventCount() > 0) ctx.BytesPerEvent = (double)store.MemoryUsage() / (double)store.EventCount();
+	return store.MemoryUsage();
+}
+
+static bool SumSize(const NetRecord & rec, void * context)
+{
+	*(uint64_t *)context += rec.size;
+	return true;
+}
+
+static uint64_t BenchHistoryScan(BenchContext & ctx)
+{
+	static HistoryStore * store = NULL; //built once, only scanning is measured
+	HistoryFilter filter;
+	uint64_t sum = 0;
+
+	if (store == NULL)
+	{
+		store = new HistoryStore((size_t)1 << 40);
+		for (size_t i = 0; i < ctx.records.size(); i++) store->Append(ctx.records[i]);
+		store->Seal();
+	}
+
+	filter.port = 443;
+	store->Scan(filter, SumSize, &sum);
+	return sum;
+}
+
+static void CountAlert(const AnomalyAlert &, void * context)
+{
+	(*(uint64_t *)context)++;
+}
+
+static uint64_t BenchAnomaly(BenchContext & ctx)
+{
+	AnomalyDetector detector(4096);
+	uint64_t alerts = 0;
+
+	detector.interval = 100000; //10 ms of synthetic time = 1000 events per interval
+	detector.seasonal = true;
+	detector.callback = CountAlert;
+	detector.context = &alerts;
+	for (size_t i = 0; i < ctx.records.size(); i++) detector.Process(ctx.records[i]);
+	return alerts;
+}
+
+static void CountCoalesced(const CoalescedRecord & rec, void * context)
+{
+	*(uint64_t *)context += rec.rec.size;
+}
+
+static uint64_t BenchCoalesce(BenchContext & ctx)
+{
+	FlowCoalescer coalescer;
+	uint64_t bytes = 0;
+
+	coalescer.window = 100000; //10 ms
+	coalescer.callback = CountCoalesced;
+	coalescer.context = &bytes;
+	for (size_t i = 0; i < ctx.records.size(); i++)
+	{
+		if (!coalescer.Process(ctx.records[i], 2)) bytes++; //event passed on by the caller
+	}
+	coalescer.Flush();
+	return bytes + coalescer.RecordsOut;
+}
+
+/* Classification: direction, local addresses and byte totals, per record and in blocks */
+
+static bool IsLoopback(const uint8_t * addr, bool ip6)
+{
+	static const uint8_t loopback6[16] = { 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,1 };
+	return ip6 ? memcmp(addr, loopback6, 16) == 0 : addr[0] == 127;
+}
+
+//Results of a classification pass; every path must produce the same ones
+struct ClassifyTotals
+{
+	uint64_t sent;
+	uint64_t recv;
+	uint64_t host; //bytes exchanged between local addresses
+	uint64_t local; //events with a local source or destination
+};
+
+static ClassifyTotals ClassifyRecords(BenchContext & ctx)
+{
+	ClassifyTotals t = {0, 0, 0, 0};
+
+	for (size_t i = 0; i < ctx.records.size(); i++)
+	{
+		const NetRecord & rec = ctx.records[i];
+		uint64_t bytes = (uint64_t)rec.size * rec.weight;
+		bool ip6 = rec.ip6 != 0;
+		bool LocalSrc = IsLocal(ctx, rec.saddr, ip6);
+		bool LocalDst = IsLocal(ctx, rec.daddr, ip6);
+
+		if (NetOpcodeIsSend(rec.opcode)) t.sent += bytes;
+		else if (NetOpcodeIsRecv(rec.opcode)) t.recv += bytes;
+		else bytes = 0;
+		if (IsLoopback(rec.saddr, ip6) || IsLoopback(rec.daddr, ip6) || (LocalSrc && LocalDst)) t.host += bytes;
+		if (LocalSrc || LocalDst) t.local++;
+	}
+	return t;
+}
+
+static ClassifyTotals ClassifyBatches(BenchContext & ctx, NetBatchIsa isa)
+{
+	ClassifyTotals t;
+	std::vector<NetBatch> block(1);
+	NetBatch & b = block[0];
+	NetLocalAddresses local;
+	NetBatchTotals totals = {0, 0, 0};
+	NetBatchIsa saved = NetBatchGetIsa();
+	uint64_t matched = 0;
+	size_t i = 0;
+
+	NetLocalAddressesClear(&local);
+	for (size_t j = 0; j < ctx.LocalAddresses.size(); j++)
+	{
+		NetLocalAddressesAdd(&local, ctx.LocalAddresses[j].saddr, ctx.LocalAddresses[j].ip6 != 0);
+	}
+
+	NetBatchSetIsa(isa);
+	while (i < ctx.records.size())
+	{
+		b.count = 0;
+		while (i < ctx.records.size() && NetBatchAppendRecord(&b, ctx.records[i])) i++;
+		NetBatchProcess(&b, local, &totals);
+		for (uint32_t k = 0; k < b.count; k++)
+		{
+			if (b.flags[k] & (NET_CLASS_LOCAL_SRC | NET_CLASS_LOCAL_DST)) matched++;
+		}
+	}
+	NetBatchSetIsa(saved);
+
+	t.sent = totals.SentBytes;
+	t.recv = totals.RecvBytes;
+	t.host = totals.LocalBytes;
+	t.local = matched;
+	return t;
+}
+
+static uint64_t SumTotals(const ClassifyTotals & t)
+{
+	return t.sent + t.recv + t.host + t.local;
+}
+
+static uint64_t BenchClassify(BenchContext & ctx)
+{
+	return SumTotals(ClassifyRecords(ctx));
+}
+
+static uint64_t BenchClassifyBatch(BenchContext & ctx)
+{
+	return SumTotals(ClassifyBatches(ctx, NetBatchAvx2)); //best supported
+}
+
+static uint64_t BenchClassifyBatchScalar(BenchContext & ctx)
+{
+	return SumTotals(ClassifyBatches(ctx, NetBatchScalar));
+}
+
+//The batch kernels of every instruction set this CPU supports must agree with the per-record path
+static bool CheckClassify(BenchContext & ctx)
+{
+	static const char * names[] = { "scalar", "sse4.1", "avx2" };
+	ClassifyTotals expected = ClassifyRecords(ctx);
+	bool ok = true;
+
+	for (int isa = NetBatchScalar; isa <= NetBatchSupportedIsa(); isa++)
+	{
+		ClassifyTotals t = ClassifyBatches(ctx, (NetBatchIsa)isa);
+
+		if (memcmp(&t, &expected, sizeof(t)) == 0) continue;
+		fprintf(stderr, "classify-batch (%s) disagrees with classify: sent %llu/%llu recv %llu/%llu host %llu/%llu local %llu/%llu\n",
+			names[isa], (unsigned long long)t.sent, (unsigned long long)expected.sent,
+			(unsigned long long)t.recv, (unsigned long long)expected.recv,
+			(unsigned long long)t.host, (unsigned long long)expected.host,
+			(unsigned long long)t.local, (unsigned long long)expected.local);
+		ok = false;
+	}
+	return ok;
+}
+
+#ifdef _WIN32
+#define BENCH_SHARED_RING "Local\\EtwNetworkBench"
+#else
+#define BENCH_SHARED_RING "/EtwNetworkBench"
+#endif
+
+//Publisher never waits: records the reader thread does not keep up with are counted as lost
+static uint64_t BenchSharedRing(BenchContext & ctx)
+{
+	SharedRingWriter writer;
+	SharedRingReader reader;
+	std::atomic<bool> done(false);
+	uint64_t read = 0;
+
+	if (!writer.Create(BENCH_SHARED_RING, 65536) || !reader.Open(BENCH_SHARED_RING))
+	{
+		fprintf(stderr, "shared-ring: cannot create %s (error %d)\n", BENCH_SHARED_RING, writer.Error());
+		return 0;
+	}
+
+	std::thread consumer([&reader, &done, &read]() {
+		std::vector<NetRecord> batch(1024);
+		for (;;)
+		{
+			bool last = done.load(std::memory_order_acquire);
+			uint32_t n = reader.Read(&batch[0], (uint32_t)batch.size());
+			read += n;
+			if (n == 0)
+			{
+				if (last) break;
+				std::this_thread::yield();
+			}
+		}
+	});
+
+	for (size_t i = 0; i < ctx.records.size(); i++) writer.Publish(ctx.records[i]);
+	done.store(true, std::memory_order_release);
+	consumer.join();
+	return read + reader.lost;
+}
+
+/* End-to-end: decode, sample, hand off to the consumer thread, aggregate */
+
+static uint64_t BenchEndToEnd(BenchContext & ctx)
+{
+	const Workload & w = ctx.workload;
+	RecordRing ring(4096);
+	AdaptiveSampler sampler;
+	std::atomic<bool> done(false);
+	std::unordered_map<uint32_t, FlowTotals> table;
+
+	std::thread consumer([&ring, &done, &table]() {
+		NetRecord rec;
+		for (;;)
+		{
+			if (ring.TryPop(rec)) Aggregate(table, rec);
+			else if (done.load(std::memory_order_acquire))
+			{
+				while (ring.TryPop(rec)) Aggregate(table, rec);
+				break;
+			}
+			else std::this_thread::yield();
+		}
+	});
+
+	for (size_t i = 0; i < w.events.size(); i++)
+	{
+		const SyntheticEvent & e = w.events[i];
+		NetRecord rec;
+
+		if (!DecodeNetRecord(e.proto, e.opcode, &w.data[e.offset], e.length, &rec)) continue;
+		rec.timestamp = e.timestamp;
+		if (NetOpcodeIsData(rec.opcode))
+		{
+			rec.weight = sampler.SampleFlow(NetRecordFlowHash(&rec));
+			if (rec.weight == 0) continue;
+		}
+		while (!ring.TryPush(rec)) std::this_thread::yield();
+	}
+	done.store(true, std::memory_order_release);
+	consumer.join();
+	return table.size();
+}
+
+static const Benchmark Benchmarks[] = {
+	{ "decode", BenchDecode },
+	{ "decode-plan", BenchDecodePlan },
+	{ "filter", BenchFilter },
+	{ "aggregate", BenchAggregate },
+	{ "classify", BenchClassify },
+	{ "classify-batch", BenchClassifyBatch },
+	{ "classify-batch-scalar", BenchClassifyBatchScalar },
+	{ "sample", BenchSample },
+	{ "ring", BenchRing },
+	{ "export", BenchExport },
+	{ "history-append", BenchHistoryAppend },
+	{ "history-scan", BenchHistoryScan },
+	{ "anomaly", BenchAnomaly },
+	{ "coalesce", BenchCoalesce },
+	{ "shared-ring", BenchSharedRing },
+	{ "end-to-end", BenchEndToEnd },
+};
+
+/* Harness */
+
+static void PrepareContext(BenchContext & ctx, const WorkloadSettings & s)
+{
+	NetRecord rec;
+
+	ctx.workload.Generate(s);
+	ctx.records.clear();
+	ctx.records.reserve(ctx.workload.events.size());
+
+	for (size_t i = 0; i < ctx.workload.events.size(); i++)
+	{
+		const SyntheticEvent & e = ctx.workload.events[i];
+		if (DecodeNetRecord(e.proto, e.opcode, &ctx.workload.data[e.offset], e.length, &rec))
+		{
+			rec.timestamp = e.timestamp;
+			ctx.records.push_back(rec);
+		}
+	}
+
+	//the generator uses 192.168.0.10-13 and fe80::1 as local addresses
+	ctx.LocalAddresses.clear();
+	for (int k = 0; k < 5; k++)
+	{
+		memset(&rec, 0, sizeof(rec));
+		if (k < 4)
+		{
+			rec.saddr[0] = 192; rec.saddr[1] = 168; rec.saddr[2] = 0; rec.saddr[3] = (uint8_t)(10 + k);
+		}
+		else
+		{
+			rec.ip6 = 1; rec.saddr[0] = 0xFE; rec.saddr[1] = 0x80; rec.saddr[15] = 1;
+		}
+		ctx.LocalAddresses.push_back(rec);
+	}
+}
+
+static BenchResult RunBenchmark(BenchContext & ctx, const Benchmark & b, int repeat)
+{
+	BenchResult res;
+	uint64_t best = 0;
+	volatile uint64_t checksum = 0;
+	uint64_t n = (strncmp(b.name, "decode", 6) == 0 || strcmp(b.name, "end-to-end") == 0) ?
+		ctx.workload.events.size() : ctx.records.size();
+
+	ctx.BytesPerEvent = 0;
+	b.run(ctx); //warm up
+
+	for (int r = 0; r < repeat; r++)
+	{
+		uint64_t start = NowNs();
+		checksum += b.run(ctx);
+		uint64_t elapsed = NowNs() - start;
+		if (r == 0 || elapsed < best) best = elapsed;
+	}
+
+	res.name = b.name;
+	res.events = n;
+	res.NsPerEvent = n > 0 ? (double)best / (double)n : 0;
+	res.EventsPerSec = best > 0 ? (double)n * 1000000000.0 / (double)best : 0;
+	res.BytesPerEvent = ctx.BytesPerEvent;
+	return res;
+}
+
+//Workload line written at the top of the results; a baseline is only comparable with the same workload
+static void FormatWorkload(char * buf, size_t size, const WorkloadSettings & s)
+{
+	snprintf(buf, size, "# events=%u flows=%u flow_skew=%.2f size_skew=%.2f send=%u recv=%u ip6=%u udp=%u seed=%llu",
+		s.events, s.flows, s.FlowSkew, s.SizeSkew, s.SendShare, s.RecvShare, s.Ip6Share, s.UdpShare,
+		(unsigned long long)s.seed);
+}
+
+static void WriteResults(FILE * f, const WorkloadSettings & s, const std::vector<BenchResult> & results)
+{
+	char workload[256];
+
+	FormatWorkload(workload, sizeof(workload), s);
+	fprintf(f, "%s\n", workload);
+	fprintf(f, "benchmark,events,ns_per_event,events_per_sec,bytes_per_event\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		fprintf(f, "%s,%llu,%.3f,%.0f,", results[i].name.c_str(), (unsigned long long)results[i].events,
+			results[i].NsPerEvent, results[i].EventsPerSec);
+		if (results[i].BytesPerEvent > 0) fprintf(f, "%.2f", results[i].BytesPerEvent);
+		fprintf(f, "\n");
+	}
+}
+
+// Compares ns/event with the baseline file (written by --out earlier).
+// Returns the number of benchmarks that are slower than baseline by more than "tolerance" percent,
+// or -1 if the file can't be read or was measured on a different workload.
+
+//Checked before anything runs: false if the baseline can't be read or was measured on another workload
+static bool CheckBaseline(const char * path, const WorkloadSettings & s)
+{
+	FILE * f = fopen(path, "r");
+	char line[512];
+	char workload[256];
+	bool ok = true;
+
+	if (f == NULL)
+	{
+		fprintf(stderr, "Can't open baseline file %s\n", path);
+		return false;
+	}
+
+	FormatWorkload(workload, sizeof(workload), s);
+	if (fgets(line, sizeof(line), f) == NULL || line[0] != '#')
+	{
+		fprintf(stderr, "Baseline file %s has no workload line, it may have been measured on another workload\n", path);
+	}
+	else
+	{
+		line[strcspn(line, "\r\n")] = 0;
+		if (strcmp(line, workload) != 0)
+		{
+			fprintf(stderr, "Baseline file %s was measured on another workload:\n  baseline: %s\n  this run: %s\n",
+				path, line, workload);
+			ok = false;
+		}
+	}
+
+	fclose(f);
+	return ok;
+}
+
+//Returns the number of benchmarks slower than the baseline allows, -1 if it can't be read
+static int CompareBaseline(const char * path, const std::vector<BenchResult> & results, double tolerance)
+{
+	FILE * f = fopen(path, "r");
+	char line[512];
+	int regressions = 0;
+
+	if (f == NULL)
+	{
+		fprintf(stderr, "Can't open baseline file %s\n", path);
+		return -1;
+	}
+
+	printf("\nbenchmark,baseline_ns_per_event,ns_per_event,change_percent,status\n");
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		char name[128];
+		unsigned long long events;
+		double ns;
+
+		if (line[0] == '#') continue;
+		if (sscanf(line, "%127[^,],%llu,%lf", name, &events, &ns) != 3) continue; //header or garbage
+
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			if (results[i].name != name || ns <= 0) continue;
+
+			double change = (results[i].NsPerEvent - ns) * 100.0 / ns;
+			const char * status = "ok";
+			if (change > tolerance) { status = "REGRESSION"; regressions++; }
+			else if (change < -tolerance) status = "improved";
+			printf("%s,%.3f,%.3f,%+.1f,%s\n", name, ns, results[i].NsPerEvent, change, status);
+		}
+	}
+
+	fclose(f);
+	return regressions;
+}
+
+static void PrintUsage()
+{
+	printf("Usage: EtwNetworkBench [options]\n"
+		"  --events N        number of synthetic events (default 1000000)\n"
+		"  --flows N         number of distinct flows (default 10000)\n"
+		"  --flow-skew S     Zipf exponent of flow popularity (default 1.0)\n"
+		"  --size-skew S     Zipf exponent of event sizes (default 1.2)\n"
+		"  --send P          percent of send events (default 45)\n"
+		"  --recv P          percent of receive events (default 45)\n"
+		"  --ip6 P           percent of IPv6 flows (default 20)\n"
+		"  --udp P           percent of UDP flows (default 10)\n"
+		"  --seed N          workload seed (default 1)\n"
+		"  --repeat N        runs per benchmark, the best one is reported (default 5)\n"
+		"  --only NAME       run only the named benchmark\n"
+		"  --out FILE        also write the results to FILE\n"
+		"  --baseline FILE   compare with results stored by an earlier --out on the same workload\n"
+		"  --tolerance P     allowed slowdown against baseline, percent (default 10)\n"
+		"Exit code: 1 if a benchmark is slower than the baseline allows, 2 for invalid arguments or a baseline\n"
+		"of another workload, 3 if the classification paths disagree on the workload\n");
+}
+
+int main(int argc, char * argv[])
+{
+	WorkloadSettings settings;
+	int repeat = 5;
+	const char * only = NULL;
+	const char * out = NULL;
+	const char * baseline = NULL;
+	double tolerance = 10;
+	std::vector<BenchResult> results;
+	BenchContext ctx;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char * arg = argv[i];
+		const char * val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) { PrintUsage(); return 0; }
+		if (val == NULL) { PrintUsage(); return 2; }
+		i++;
+
+		if (strcmp(arg, "--events") == 0) settings.events = (uint32_t)strtoul(val, NULL, 10);
+		else if (strcmp(arg, "--flows") == 0) settings.flows = (uint32_t)strtoul(val, NULL, 10);
+		else if (strcmp(arg, "--flow-skew") == 0) settings.FlowSkew = atof(val);
+		else if (strcmp(arg, "--size-skew") == 0) settings.SizeSkew = atof(val);
+		else if (strcmp(arg, "--send") == 0) settings.SendShare = (uint32_t)strtoul(val, NULL, 10);
+		else if (strcmp(arg, "--recv") == 0) settings.RecvShare = (uint32_t)strtoul(val, NULL, 10);
+		else if (strcmp(arg, "--ip6") == 0) settings.Ip6Share = (uint32_t)strtoul(val, NULL, 10);
+		else if (strcmp(arg, "--udp") == 0) settings.UdpShare = (uint32_t)strtoul(val, NULL, 10);
+		else if (strcmp(arg, "--seed") == 0) settings.seed = strtoull(val, NULL, 10);
+		else if (strcmp(arg, "--repeat") == 0) repeat = atoi(val);
+		else if (strcmp(arg, "--only") == 0) only = val;
+		else if (strcmp(arg, "--out") == 0) out = val;
+		else if (strcmp(arg, "--baseline") == 0) baseline = val;
+		else if (strcmp(arg, "--tolerance") == 0) tolerance = atof(val);
+		else { PrintUsage(); return 2; }
+	}
+
+	if (settings.SendShare + settings.RecvShare > 100 || settings.flows == 0 || repeat < 1)
+	{
+		fprintf(stderr, "Invalid workload settings\n");
+		return 2;
+	}
+
+	if (baseline != NULL && !CheckBaseline(baseline, settings)) return 2;
+
+	PrepareContext(ctx, settings);
+
+	if ((only == NULL || strncmp(only, "classify", 8) == 0) && !CheckClassify(ctx)) return 3;
+
+	for (size_t i = 0; i < sizeof(Benchmarks) / sizeof(Benchmarks[0]); i++)
+	{
+		if (only != NULL && strcmp(only, Benchmarks[i].name) != 0) continue;
+		results.push_back(RunBenchmark(ctx, Benchmarks[i], repeat));
+	}
+
+	WriteResults(stdout, settings, results);
+
+	if (out != NULL)
+	{
+		FILE * f = fopen(out, "w");
+		if (f == NULL) { fprintf(stderr, "Can't write %s\n", out); return 2; }
+		WriteResults(f, settings, results);
+		fclose(f);
+	}
+
+	if (baseline != NULL)
+	{
+		int regressions = CompareBaseline(baseline, results, tolerance);
+		if (regressions < 0) return 2;
+		if (regressions > 0) return 1;
+	}
+
+	return 0;
+}
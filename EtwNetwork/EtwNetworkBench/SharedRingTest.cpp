@@ -0,0 +1,330 @@
+// Tests of the shared-memory ring (SharedRing.cpp) on Linux: writer and readers in separate processes and
+// threads, lapping, takeover of a ring left by a dead writer, a writer that closed cleanly and a second writer
+// on the same name.
+// Build and run:
+//   g++ -std=c++11 -O2 -I../EtwNetwork SharedRingTest.cpp ../EtwNetwork/SharedRing.cpp -o SharedRingTest -lpthread -lrt
+//   ./SharedRingTest
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "NetRecord.h"
+#include "SharedRing.h"
+
+using namespace EtwNetwork;
+
+#define TEST_RING "/EtwNetworkRingTest"
+#define TEST_TIMEOUT 60 //seconds; a reader that hangs fails the run instead of blocking it
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; return; } } while (0)
+
+static NetRecord MakeRecord(uint64_t i)
+{
+	NetRecord rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.timestamp = 130000000000000000ULL + i * 10000; //1 ms apart
+	rec.pid = 1000 + (uint32_t)(i % 7);
+	rec.size = (uint32_t)(i * 7 + 1);
+	rec.opcode = (i % 2) ? NET_OPCODE_RECV : NET_OPCODE_SEND;
+	rec.proto = NET_PROTO_TCP;
+	rec.daddr[0] = 10; rec.daddr[3] = (uint8_t)i;
+	rec.saddr[0] = 192; rec.saddr[1] = 168; rec.saddr[3] = 1;
+	rec.dport = 443;
+	rec.sport = (uint16_t)(40000 + i % 1000);
+	rec.weight = 1;
+	return rec;
+}
+
+static bool SameRecord(const NetRecord & a, uint64_t i)
+{
+	NetRecord b = MakeRecord(i);
+	return memcmp(&a, &b, sizeof(NetRecord)) == 0;
+}
+
+//Index of the record, from its timestamp
+static uint64_t IndexOf(const NetRecord & rec)
+{
+	return (rec.timestamp - 130000000000000000ULL) / 10000;
+}
+
+/* Writer in this process, reader in a child process */
+
+static void TestRoundTrip()
+{
+	const uint32_t N = 1000;
+	SharedRingWriter writer;
+	int ready[2];
+	pid_t child;
+	int status = 0;
+
+	CHECK(writer.Create(TEST_RING, 4096));
+	CHECK(pipe(ready) == 0);
+
+	child = fork();
+	CHECK(child >= 0);
+	if (child == 0)
+	{
+		SharedRingReader reader;
+		std::vector<NetRecord> buf(N);
+		SharedAggregates a;
+		uint64_t sent = 0, recv = 0;
+		uint32_t got = 0;
+		char c = 1;
+
+		if (!reader.Open(TEST_RING)) _exit(2);
+		if (write(ready[1], &c, 1) != 1) _exit(3);
+
+		while (got < N)
+		{
+			uint32_t n = reader.Read(&buf[got], N - got);
+			if (n == 0) usleep(100);
+			got += n;
+		}
+		for (uint32_t i = 0; i < N; i++)
+		{
+			if (!SameRecord(buf[i], i)) _exit(4);
+			if (NetOpcodeIsSend(buf[i].opcode)) sent += buf[i].size; else recv += buf[i].size;
+		}
+		if (reader.lost != 0 || reader.Read(&buf[0], 1) != 0) _exit(5);
+		if (!reader.ReadAggregates(&a) || a.events != N || a.SentBytes != sent || a.RecvBytes != recv) _exit(6);
+		if (!reader.WriterActive()) _exit(7);
+		_exit(0);
+	}
+
+	char c;
+	CHECK(read(ready[0], &c, 1) == 1);
+	for (uint32_t i = 0; i < N; i++) writer.Publish(MakeRecord(i));
+	CHECK(waitpid(child, &status, 0) == child);
+	close(ready[0]);
+	close(ready[1]);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	CHECK(writer.Published() == N);
+}
+
+/* A reader that falls behind loses the oldest records, counts them and keeps reading in order */
+
+static void TestLapping()
+{
+	SharedRingWriter writer;
+	SharedRingReader reader;
+	std::vector<NetRecord> buf(1000);
+	uint32_t n;
+
+	CHECK(writer.Create(TEST_RING, 16));
+	CHECK(writer.Capacity() == 16);
+	CHECK(reader.Open(TEST_RING));
+
+	for (uint64_t i = 0; i < 100; i++) writer.Publish(MakeRecord(i));
+	n = reader.Read(&buf[0], (uint32_t)buf.size());
+	CHECK(n > 0 && n <= 16);
+	CHECK(n + reader.lost == 100);
+	for (uint32_t i = 0; i < n; i++) CHECK(SameRecord(buf[i], reader.lost + i));
+	CHECK(reader.Read(&buf[0], (uint32_t)buf.size()) == 0);
+
+	//the next records are read without loss
+	for (uint64_t i = 100; i < 110; i++) writer.Publish(MakeRecord(i));
+	CHECK(reader.Read(&buf[0], (uint32_t)buf.size()) == 10);
+	CHECK(SameRecord(buf[0], 100) && SameRecord(buf[9], 109));
+	CHECK(reader.lost == 100 - n);
+}
+
+//Same with the writer running concurrently: every record is either read intact, in order, or counted as lost
+static void TestConcurrentLapping()
+{
+	const uint64_t N = 2000000;
+	SharedRingWriter writer;
+	SharedRingReader reader;
+	std::atomic<bool> done(false);
+	uint64_t read = 0, bad = 0, next = 0;
+
+	CHECK(writer.Create(TEST_RING, 1024));
+	CHECK(reader.Open(TEST_RING));
+
+	std::thread consumer([&]() {
+		std::vector<NetRecord> buf(256);
+		for (;;)
+		{
+			bool last = done.load(std::memory_order_acquire);
+			uint32_t n = reader.Read(&buf[0], (uint32_t)buf.size());
+			for (uint32_t i = 0; i < n; i++)
+			{
+				uint64_t index = IndexOf(buf[i]);
+				if (index < next || !SameRecord(buf[i], index)) bad++;
+				next = index + 1;
+			}
+			read += n;
+			if (n == 0)
+			{
+				if (last) break;
+				std::this_thread::yield();
+			}
+		}
+	});
+
+	for (uint64_t i = 0; i < N; i++) writer.Publish(MakeRecord(i));
+	done.store(true, std::memory_order_release);
+	consumer.join();
+
+	CHECK(bad == 0);
+	CHECK(read + reader.lost == N);
+}
+
+/* A ring left by a dead writer is taken over; attached readers follow the new ring, with its new capacity */
+
+static void TestRestart()
+{
+	SharedRingReader reader;
+	SharedRingWriter writer;
+	std::vector<NetRecord> buf(100);
+	int ready[2], go[2];
+	pid_t child;
+	int status = 0;
+	char c = 1;
+
+	CHECK(pipe(ready) == 0 && pipe(go) == 0);
+
+	child = fork();
+	CHECK(child >= 0);
+	if (child == 0)
+	{
+		//leaks the ring on purpose: exits without Close, as a crashed publisher would
+		SharedRingWriter * w = new SharedRingWriter();
+		if (!w->Create(TEST_RING, 16)) _exit(2);
+		if (write(ready[1], &c, 1) != 1 || read(go[0], &c, 1) != 1) _exit(3);
+		for (uint64_t i = 0; i < 10; i++) w->Publish(MakeRecord(i));
+		_exit(0);
+	}
+
+	CHECK(read(ready[0], &c, 1) == 1);
+	CHECK(reader.Open(TEST_RING));
+	CHECK(reader.Capacity() == 16);
+	CHECK(write(go[1], &c, 1) == 1);
+	CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	close(ready[0]); close(ready[1]); close(go[0]); close(go[1]);
+
+	CHECK(reader.Read(&buf[0], 100) == 10);
+	CHECK(SameRecord(buf[9], 9));
+
+	CHECK(writer.Create(TEST_RING, 64));
+	for (uint64_t i = 1000; i < 1040; i++) writer.Publish(MakeRecord(i));
+
+	CHECK(reader.Read(&buf[0], 100) == 40);
+	CHECK(reader.Capacity() == 64);
+	CHECK(SameRecord(buf[0], 1000) && SameRecord(buf[39], 1039));
+	CHECK(reader.lost == 0);
+	CHECK(reader.WriterActive());
+
+	//a closed ring goes away with its name
+	writer.Close();
+	CHECK(!reader.WriterActive());
+	SharedRingReader late;
+	CHECK(!late.Open(TEST_RING));
+}
+
+/* A writer that closes cleanly removes the name; attached readers read what is left, then follow the next writer */
+
+static void TestClosedWriter()
+{
+	SharedRingReader reader;
+	SharedRingWriter writer;
+	std::vector<NetRecord> buf(100);
+
+	CHECK(writer.Create(TEST_RING, 64));
+	CHECK(reader.Open(TEST_RING));
+	for (uint64_t i = 0; i < 10; i++) writer.Publish(MakeRecord(i));
+	CHECK(reader.Read(&buf[0], 4) == 4);
+	writer.Close();
+
+	//the rest of the closed ring is still delivered, then nothing until a new writer appears
+	CHECK(!reader.WriterActive());
+	CHECK(reader.Read(&buf[0], 100) == 6);
+	CHECK(SameRecord(buf[0], 4) && SameRecord(buf[5], 9));
+	CHECK(reader.Read(&buf[0], 100) == 0);
+	CHECK(reader.IsOpen());
+
+	CHECK(writer.Create(TEST_RING, 32));
+	for (uint64_t i = 1000; i < 1020; i++) writer.Publish(MakeRecord(i));
+
+	CHECK(reader.Read(&buf[0], 100) == 20);
+	CHECK(reader.Capacity() == 32);
+	CHECK(SameRecord(buf[0], 1000) && SameRecord(buf[19], 1019));
+	CHECK(reader.lost == 0);
+	CHECK(reader.WriterActive());
+
+	writer.Publish(MakeRecord(1020));
+	CHECK(reader.Read(&buf[0], 100) == 1);
+	CHECK(SameRecord(buf[0], 1020));
+}
+
+/* A second writer on the name of a live ring fails and leaves the ring alone */
+
+static void TestSecondWriter()
+{
+	SharedRingWriter first, second;
+	SharedRingReader reader, late;
+	std::vector<NetRecord> buf(100);
+
+	CHECK(first.Create(TEST_RING, 64));
+	CHECK(reader.Open(TEST_RING));
+	for (uint64_t i = 0; i < 20; i++) first.Publish(MakeRecord(i));
+
+	CHECK(!second.Create(TEST_RING, 64));
+	CHECK(second.Error() == EEXIST);
+	CHECK(!second.IsOpen());
+
+	for (uint64_t i = 20; i < 30; i++) first.Publish(MakeRecord(i));
+	CHECK(reader.Read(&buf[0], 100) == 30);
+	for (uint32_t i = 0; i < 30; i++) CHECK(SameRecord(buf[i], i));
+	CHECK(reader.lost == 0);
+
+	//the failed writer did not remove the name
+	CHECK(late.Open(TEST_RING));
+	CHECK(late.WriterActive());
+}
+
+/* Harness */
+
+struct Test
+{
+	const char * name;
+	void (*run)();
+};
+
+static const Test Tests[] = {
+	{ "round-trip", TestRoundTrip },
+	{ "lapping", TestLapping },
+	{ "concurrent-lapping", TestConcurrentLapping },
+	{ "restart", TestRestart },
+	{ "closed-writer", TestClosedWriter },
+	{ "second-writer", TestSecondWriter },
+};
+
+int main()
+{
+	alarm(TEST_TIMEOUT);
+
+	for (size_t i = 0; i < sizeof(Tests) / sizeof(Tests[0]); i++)
+	{
+		int before = failures;
+
+		shm_unlink(TEST_RING); //leftovers of an interrupted run
+		Tests[i].run();
+		printf("%s %s\n", failures == before ? "PASS" : "FAIL", Tests[i].name);
+	}
+
+	shm_unlink(TEST_RING);
+	return failures == 0 ? 0 : 1;
+}
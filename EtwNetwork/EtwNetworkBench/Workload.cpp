@@ -0,0 +1,174 @@
+//Synthetic workload generator
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "Workload.h"
+
+using namespace EtwNetwork;
+
+namespace EtwNetworkBench
+{
+
+WorkloadSettings::WorkloadSettings()
+{
+	events = 1000000;
+	flows = 10000;
+	FlowSkew = 1.0;
+	SizeSkew = 1.2;
+	SizeRanks = 1024;
+	SendShare = 45;
+	RecvShare = 45;
+	Ip6Share = 20;
+	UdpShare = 10;
+	seed = 1;
+}
+
+/* Random numbers */
+
+Random::Random(uint64_t seed)
+{
+	state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+uint64_t Random::Next()
+{
+	//splitmix64
+	uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+double Random::NextDouble()
+{
+	return (Next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+uint32_t Random::Below(uint32_t n)
+{
+	return (uint32_t)(((Next() >> 32) * n) >> 32);
+}
+
+ZipfDistribution::ZipfDistribution(uint32_t n, double s)
+{
+	double sum = 0;
+
+	if (n == 0) n = 1;
+	cdf.resize(n);
+	for (uint32_t k = 0; k < n; k++)
+	{
+		sum += 1.0 / pow((double)(k + 1), s);
+		cdf[k] = sum;
+	}
+	for (uint32_t k = 0; k < n; k++) cdf[k] /= sum;
+}
+
+uint32_t ZipfDistribution::Next(Random & rnd)
+{
+	double u = rnd.NextDouble();
+	std::vector<double>::const_iterator it = std::lower_bound(cdf.begin(), cdf.end(), u);
+
+	if (it == cdf.end()) return (uint32_t)cdf.size();
+	return (uint32_t)(it - cdf.begin()) + 1;
+}
+
+/* Workload */
+
+static void PutPort(uint8_t * p, uint16_t port)
+{
+	p[0] = (uint8_t)(port >> 8);
+	p[1] = (uint8_t)(port & 0xFF);
+}
+
+// Bytes following the common prefix (seqnum, connid and type specific fields);
+// only their length matters for decoding.
+
+static uint32_t TailLength(uint8_t opcode)
+{
+	switch (opcode)
+	{
+	case NET_OPCODE_SEND: case NET_OPCODE_SEND_IP6: return 24; //startime, endtime, seqnum, connid
+	case NET_OPCODE_CONNECT: case NET_OPCODE_CONNECT_IP6:
+	case NET_OPCODE_ACCEPT: case NET_OPCODE_ACCEPT_IP6: return 32; //mss, window options, seqnum, connid
+	default: return 16; //seqnum, connid
+	}
+}
+
+void Workload::Generate(const WorkloadSettings & s)
+{
+	Random rnd(s.seed);
+	ZipfDistribution FlowDist(s.flows, s.FlowSkew);
+	ZipfDistribution SizeDist(s.SizeRanks, s.SizeSkew);
+	static const uint8_t LifecycleOpcodes[] = {
+		NET_OPCODE_CONNECT, NET_OPCODE_DISCONNECT, NET_OPCODE_RETRANSMIT, NET_OPCODE_ACCEPT
+	};
+
+	settings = s;
+	flows.resize(s.flows > 0 ? s.flows : 1);
+	events.resize(s.events);
+	data.clear();
+	data.reserve((size_t)s.events * 56);
+
+	for (size_t i = 0; i < flows.size(); i++)
+	{
+		SyntheticFlow & f = flows[i];
+		memset(&f, 0, sizeof(f));
+		f.pid = 1000 + rnd.Below(200);
+		f.ip6 = rnd.Below(100) < s.Ip6Share;
+		f.proto = rnd.Below(100) < s.UdpShare ? NET_PROTO_UDP : NET_PROTO_TCP;
+		f.lport = (uint16_t)(49152 + rnd.Below(16384));
+		f.rport = rnd.Below(4) == 0 ? (uint16_t)(1024 + rnd.Below(60000)) : (rnd.Below(2) ? 443 : 80);
+
+		if (f.ip6)
+		{
+			f.laddr[0] = 0xFE; f.laddr[1] = 0x80; f.laddr[15] = 1; //link-local interface address
+			f.raddr[0] = 0x20; f.raddr[1] = 0x01;
+			for (int b = 2; b < 16; b++) f.raddr[b] = (uint8_t)rnd.Below(256);
+		}
+		else
+		{
+			f.laddr[0] = 192; f.laddr[1] = 168; f.laddr[2] = 0; f.laddr[3] = (uint8_t)(10 + rnd.Below(4));
+			f.raddr[0] = (uint8_t)(1 + rnd.Below(223));
+			for (int b = 1; b < 4; b++) f.raddr[b] = (uint8_t)rnd.Below(256);
+		}
+	}
+
+	for (uint32_t i = 0; i < s.events; i++)
+	{
+		const SyntheticFlow & f = flows[FlowDist.Next(rnd) - 1];
+		SyntheticEvent & e = events[i];
+		uint32_t AddrLength = f.ip6 ? 16 : 4;
+		uint32_t r = rnd.Below(100);
+		uint32_t size;
+		uint8_t opcode;
+		size_t at;
+
+		if (r < s.SendShare) opcode = NET_OPCODE_SEND;
+		else if (r < s.SendShare + s.RecvShare) opcode = NET_OPCODE_RECV;
+		else opcode = LifecycleOpcodes[rnd.Below(4)];
+		if (f.proto == NET_PROTO_UDP && !NetOpcodeIsData(opcode)) opcode = NET_OPCODE_RECV; //UDP has no connections
+		if (f.ip6) opcode = (uint8_t)(opcode + 16); //IPv6 opcodes follow the IPv4 ones in the same order
+
+		size = NetOpcodeIsData(opcode) ? SizeDist.Next(rnd) * 64 : 0;
+
+		//PID, size, daddr (remote), saddr (local), dport, sport, tail
+		at = data.size();
+		data.resize(at + 12 + 2 * AddrLength + TailLength(opcode));
+		memcpy(&data[at], &f.pid, 4);
+		memcpy(&data[at + 4], &size, 4);
+		memcpy(&data[at + 8], f.raddr, AddrLength);
+		memcpy(&data[at + 8 + AddrLength], f.laddr, AddrLength);
+		PutPort(&data[at + 8 + 2 * AddrLength], f.rport);
+		PutPort(&data[at + 10 + 2 * AddrLength], f.lport);
+
+		e.timestamp = 131000000000000000ULL + (uint64_t)i * 10;
+		e.offset = (uint32_t)at;
+		e.length = (uint16_t)(data.size() - at);
+		e.proto = f.proto;
+		e.opcode = opcode;
+	}
+}
+
+} // END NAMESPACE
@@ -0,0 +1,81 @@
+//Synthetic workload generator: produces raw TcpIp/UdpIp event payloads as the kernel logs them
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "NetRecord.h"
+
+namespace EtwNetworkBench
+{
+
+struct WorkloadSettings
+{
+	uint32_t events; //number of events to generate
+	uint32_t flows; //number of distinct connections
+	double FlowSkew; //Zipf exponent of flow popularity (0 = uniform)
+	double SizeSkew; //Zipf exponent of event sizes; size rank k is k * 64 bytes
+	uint32_t SizeRanks; //number of distinct sizes
+	uint32_t SendShare; //percent of send events
+	uint32_t RecvShare; //percent of receive events, the rest are connect/disconnect/retransmit/accept
+	uint32_t Ip6Share; //percent of IPv6 flows
+	uint32_t UdpShare; //percent of UDP flows
+	uint64_t seed;
+
+	WorkloadSettings();
+};
+
+struct SyntheticEvent
+{
+	uint64_t timestamp; //FILETIME, events are 1 us apart
+	uint32_t offset; //offset of the UserData in Workload::data
+	uint16_t length; //UserDataLength
+	uint8_t proto;
+	uint8_t opcode;
+};
+
+struct SyntheticFlow
+{
+	uint32_t pid;
+	uint8_t laddr[16];
+	uint8_t raddr[16];
+	uint16_t lport;
+	uint16_t rport;
+	uint8_t proto;
+	uint8_t ip6;
+};
+
+class Workload
+{
+public:
+	WorkloadSettings settings;
+	std::vector<SyntheticFlow> flows;
+	std::vector<SyntheticEvent> events;
+	std::vector<uint8_t> data; //UserData of all events, back to back
+
+	void Generate(const WorkloadSettings & s);
+};
+
+//Deterministic random numbers, so the same settings always produce the same workload
+class Random
+{
+public:
+	Random(uint64_t seed);
+	uint64_t Next();
+	double NextDouble(); //[0, 1)
+	uint32_t Below(uint32_t n);
+private:
+	uint64_t state;
+};
+
+//Draws ranks 1..n with probability proportional to 1/k^s
+class ZipfDistribution
+{
+public:
+	ZipfDistribution(uint32_t n, double s);
+	uint32_t Next(Random & rnd);
+private:
+	std::vector<double> cdf;
+};
+
+} // END NAMESPACE
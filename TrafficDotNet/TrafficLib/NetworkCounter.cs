@@ -26,7 +26,8 @@ namespace TrafficLib
         public abstract bool EventFilter(NetworkEvent e);
 
         /// <summary>
-        /// Adds new network event into this counter object, incrementing counters if it matches the condition
+        /// Adds new network event into this counter object, incrementing counters if it matches the condition.
+        /// Sampled events are counted with their weight, so the totals remain unbiased estimates
         /// </summary>
         /// <param name="e"></param>
         public void ProcessEvent(NetworkEvent e)
@@ -38,13 +39,13 @@ namespace TrafficLib
                 { 
                     if (e.Direction == TrafficDirections.Send)
                     {
-                        _SentBytes += e.TotalLength;
-                        _TotalBytes += e.TotalLength;
+                        _SentBytes += e.WeightedLength;
+                        _TotalBytes += e.WeightedLength;
                     }
                     else if (e.Direction == TrafficDirections.Recv)
                     {
-                        _RecvBytes += e.TotalLength;
-                        _TotalBytes += e.TotalLength;
+                        _RecvBytes += e.WeightedLength;
+                        _TotalBytes += e.WeightedLength;
                     }
                 }
             }
@@ -57,6 +57,21 @@ namespace TrafficLib
         /// </summary>
         protected DateTime _Timestamp;
 
+        /// <summary>
+        /// Number of original events this event represents (greater than 1 when the event source samples events)
+        /// </summary>
+        protected uint _Weight = 1;
+
+        /// <summary>
+        /// Number of consecutive events of a connection merged into this one by the event source
+        /// </summary>
+        protected uint _Count = 1;
+
+        /// <summary>
+        /// Time of the last merged event
+        /// </summary>
+        protected DateTime _LastTimestamp;
+
         //Public properties
 
         /// <summary>
@@ -94,6 +109,28 @@ namespace TrafficLib
         /// </summary>
         public DateTime Timestamp { get { return _Timestamp; } }
 
+        /// <summary>
+        /// Number of original events this event represents. When the event source samples events under overload, 
+        /// each passed event stands for Weight events, so TotalLength * Weight is an unbiased estimate of the traffic
+        /// </summary>
+        public uint Weight { get { return _Weight; } }
+
+        /// <summary>
+        /// Estimated amount of data transferred by all events this event represents, in bytes
+        /// </summary>
+        public long WeightedLength { get { return (long)_TotalLen * _Weight; } }
+
+        /// <summary>
+        /// Number of consecutive send or receive events of a connection this event stands for when the event source
+        /// coalesces events. TotalLength is the sum of their lengths
+        /// </summary>
+        public uint Count { get { return _Count; } }
+
+        /// <summary>
+        /// Time of the last event merged into this one (equal to Timestamp for single events)
+        /// </summary>
+        public DateTime LastTimestamp { get { return _Count > 1 ? _LastTimestamp : _Timestamp; } }
+
         /**** Methods *****/
         
         /// <summary>
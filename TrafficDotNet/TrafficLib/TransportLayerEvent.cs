@@ -103,6 +103,9 @@ namespace TrafficLib
             this._Timestamp = ev.timestamp;
             this._EventType = (TransportLayerEventTypes)ev.type;
             this._EventVersion = ev.version;
+            this._Weight = ev.weight;
+            this._Count = ev.count;
+            this._LastTimestamp = ev.LastTimestamp;
 
             if (this._EventType == TransportLayerEventTypes.EVENT_TRACE_TYPE_RECEIVE ||
                 this._EventType == TransportLayerEventTypes.RECV_IP6_EVENT)
@@ -115,6 +115,7 @@ namespace TrafficLib
             
             try
             {               
+                EtwTraffic.Enable(NetworkStats.GetLocalAddresses());
 
                 this._EndTime = DateTime.MinValue;
                 this._StartTime = DateTime.Now;
@@ -137,6 +138,17 @@ namespace TrafficLib
             this._Thread = null;
         }
 
+        /// <summary>
+        /// Gets the amounts of bytes sent and received by transport layer events since the last Start() call,
+        /// and how much of them did not leave this computer (loopback or between local addresses).
+        /// Computed natively over blocks of events, without going through NetworkEvent objects.
+        /// Returns the number of send and receive events counted
+        /// </summary>
+        public ulong GetTotals(out long SentBytes, out long RecvBytes, out long LocalBytes)
+        {
+            return EtwTraffic.GetTotals(out SentBytes, out RecvBytes, out LocalBytes);
+        }
+
         //*** INetworkEvents ***
         public DateTime EndTime
         {